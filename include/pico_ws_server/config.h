@@ -0,0 +1,103 @@
+#ifndef __PICO_WS_SERVER_CONFIG_H__
+#define __PICO_WS_SERVER_CONFIG_H__
+
+// Compile-time limits and features. Each may be overridden with a compile definition, normally via the CMake
+// cache variables of the same name (see CMakeLists.txt).
+
+// Largest frame payload accepted when reassembling a message (not applicable to streaming receive)
+#ifndef PICO_WS_SERVER_MAX_PAYLOAD_SIZE
+#define PICO_WS_SERVER_MAX_PAYLOAD_SIZE 64000
+#endif
+
+// Largest reassembled message accepted, larger messages close the connection with status 1009
+#ifndef PICO_WS_SERVER_MAX_MESSAGE_SIZE
+#define PICO_WS_SERVER_MAX_MESSAGE_SIZE 64000
+#endif
+
+// Most frames a fragmented message may be split into
+#ifndef PICO_WS_SERVER_MAX_MESSAGE_FRAMES
+#define PICO_WS_SERVER_MAX_MESSAGE_FRAMES 1024
+#endif
+
+// Longest HTTP request accepted before the upgrade
+#ifndef PICO_WS_SERVER_MAX_REQUEST_SIZE
+#define PICO_WS_SERVER_MAX_REQUEST_SIZE 4096
+#endif
+
+// Longest HTTP header line retained, longer lines are truncated
+#ifndef PICO_WS_SERVER_HTTP_HEADER_BUF_SIZE
+#define PICO_WS_SERVER_HTTP_HEADER_BUF_SIZE 64
+#endif
+
+// Size of each write when serving static HTML
+#ifndef PICO_WS_SERVER_HTML_CHUNK_SIZE
+#define PICO_WS_SERVER_HTML_CHUNK_SIZE 512
+#endif
+
+// lwIP poll interval for each connection, in units of the TCP coarse timer (around 500 ms)
+#ifndef PICO_WS_SERVER_POLL_INTERVAL
+#define PICO_WS_SERVER_POLL_INTERVAL 10
+#endif
+
+// Most zero-copy sends awaiting acknowledgement per connection
+#ifndef PICO_WS_SERVER_MAX_ZERO_COPY_SENDS
+#define PICO_WS_SERVER_MAX_ZERO_COPY_SENDS 4
+#endif
+
+// Shared frames (broadcasts, topics, prepared messages) up to this size are copied into the send buffer rather than
+// referenced. Referenced frames are tracked like zero-copy sends, so a connection closed while one is unacknowledged
+// is aborted instead of closed gracefully.
+#ifndef PICO_WS_SERVER_SHARED_FRAME_COPY_SIZE
+#define PICO_WS_SERVER_SHARED_FRAME_COPY_SIZE 1024
+#endif
+
+// Send buffer (bytes) kept free of data frames, so PING/PONG/CLOSE can still be sent when data is backed up
+#ifndef PICO_WS_SERVER_CONTROL_HEADROOM
+#define PICO_WS_SERVER_CONTROL_HEADROOM 256
+#endif
+
+// Most control frames waiting to be sent per connection, ahead of queued data frames
+#ifndef PICO_WS_SERVER_CONTROL_QUEUE_SIZE
+#define PICO_WS_SERVER_CONTROL_QUEUE_SIZE 4
+#endif
+
+// Conflation slots per connection for sendLatest() (at least 1)
+#ifndef PICO_WS_SERVER_LATEST_SLOTS
+#define PICO_WS_SERVER_LATEST_SLOTS 4
+#endif
+
+// Resolution of the keepalive and idle timeout timers, in milliseconds
+#ifndef PICO_WS_SERVER_TIMER_TICK_MS
+#define PICO_WS_SERVER_TIMER_TICK_MS 250
+#endif
+
+// Topics for subscribe()/publish(), numbered from 0
+#ifndef PICO_WS_SERVER_MAX_TOPICS
+#define PICO_WS_SERVER_MAX_TOPICS 8
+#endif
+
+// Serve the static HTML file to non-WebSocket requests (otherwise, they get 404 Not Found)
+#ifndef PICO_WS_SERVER_STATIC_HTML
+#define PICO_WS_SERVER_STATIC_HTML 1
+#endif
+
+// sendPing(), keepalive, and the PONG callback. Received PINGs are answered regardless, as required by RFC 6455.
+#ifndef PICO_WS_SERVER_PING
+#define PICO_WS_SERVER_PING 1
+#endif
+
+// Round-trip time measurement with PINGs, see getConnectionStats(). Requires PICO_WS_SERVER_PING.
+#ifndef PICO_WS_SERVER_RTT
+#define PICO_WS_SERVER_RTT 0
+#endif
+
+#if PICO_WS_SERVER_RTT && !PICO_WS_SERVER_PING
+#error "PICO_WS_SERVER_RTT requires PICO_WS_SERVER_PING"
+#endif
+
+// broadcastMessage() and topics
+#ifndef PICO_WS_SERVER_BROADCAST
+#define PICO_WS_SERVER_BROADCAST 1
+#endif
+
+#endif
@@ -1,22 +1,98 @@
 #ifndef __PICO_WS_SERVER_WEB_SOCKET_SERVER_H__
 #define __PICO_WS_SERVER_WEB_SOCKET_SERVER_H__
 
+#include <array>
 #include <cstddef>
 #include <memory>
 #include <stdint.h>
 
+#include "pico_ws_server/config.h"
+
 class WebSocketServerInternal;
 
 // Not multicore safe
 class WebSocketServer {
  public:
+  enum MessageType : uint8_t {
+    TEXT = 0x01,
+    BINARY = 0x02,
+  };
+
+  // Reference to a complete encoded frame, see prepareMessage
+  typedef void* FrameHandle;
+
+  // What happens when a message arrives and the connection's message queue is full
+  enum QueueOverflowPolicy : uint8_t {
+    // Discard the oldest queued message to make room
+    DROP_OLDEST,
+    // Discard the new message
+    DROP_NEWEST,
+    // Stop reading from the socket (the TCP receive window closes) until popMessages() makes room
+    STOP_READING,
+  };
+
+  // What happens when a received message would exceed the receive budget
+  enum ReceiveBudgetPolicy : uint8_t {
+    // Stop reading from the connection (the TCP receive window closes) until enough of the budget is released
+    DELAY_RECEIVE,
+    // Close the connection with status 1009 (Message Too Big)
+    REJECT_MESSAGE,
+  };
+
   typedef void (*ConnectCallback)(WebSocketServer& server, uint32_t conn_id);
   // Note: data can be treated as a null-terminated string if expecting TEXT messages (an extra NULL byte is allocated)
   typedef void (*MessageCallback)(WebSocketServer& server, uint32_t conn_id, const void *data, size_t len);
   typedef void (*CloseCallback)(WebSocketServer& server, uint32_t conn_id);
   typedef void (*PongCallback)(WebSocketServer& server, uint32_t conn_id, const void *data, size_t len);
 
-  WebSocketServer(uint32_t max_connections = 1);
+#if PICO_WS_SERVER_RTT
+  // Round-trip times measured with PINGs sent by the server, in microseconds
+  struct ConnectionStats {
+    static constexpr size_t RTT_BUCKETS = 16;
+
+    uint32_t pings_sent;
+    // PONGs matched to a PING, each one sample
+    uint32_t rtt_samples;
+    uint32_t rtt_last_us;
+    uint32_t rtt_min_us;
+    uint32_t rtt_max_us;
+    // Exponentially weighted moving average, each sample weighted 1/8 (as TCP's smoothed RTT)
+    uint32_t rtt_avg_us;
+    // Bucket 0 counts RTTs under 128 us, bucket i counts [64 << i, 128 << i) us, and the last bucket also counts
+    // everything longer
+    uint32_t rtt_histogram[RTT_BUCKETS];
+  };
+#endif
+
+  // One contiguous piece of a scatter-gather buffer
+  struct Segment {
+    const void* data;
+    size_t len;
+  };
+  // Note: segments point directly into received network buffers, which remain valid (and count against the
+  // lwIP pbuf pool) until release_handle is passed to releaseMessage. There is no NULL terminator.
+  typedef void (*MessageViewCallback)(WebSocketServer& server, uint32_t conn_id, const Segment* segments,
+                                      size_t segment_count, void* release_handle);
+  // success is false if the connection closed before the peer acknowledged the whole message
+  typedef void (*SendCompleteCallback)(WebSocketServer& server, uint32_t conn_id, const void* payload, bool success);
+  // Supplies the next chunk of a streamed message: point *data at up to max_size bytes of the payload starting at
+  // offset, and return how many (they are copied before the next call). Return 0 if nothing is ready yet, the
+  // stream is pulled again on the next acknowledgement from the client (or poll).
+  typedef size_t (*StreamProducer)(WebSocketServer& server, uint32_t conn_id, size_t offset, size_t max_size,
+                                   const void** data, void* arg);
+  // success is true once the whole stream has been handed to lwIP, false if the connection closed first
+  typedef void (*StreamCompleteCallback)(WebSocketServer& server, uint32_t conn_id, void* arg, bool success);
+  // queued_bytes is the size of the connection's send queue when the watermark was crossed
+  typedef void (*SendQueueCallback)(WebSocketServer& server, uint32_t conn_id, size_t queued_bytes);
+  // Note: data points into a received network buffer and is only valid for the duration of the callback.
+  // first/last mark the first and last chunk of a message; a message may arrive in any number of chunks.
+  typedef void (*FragmentCallback)(WebSocketServer& server, uint32_t conn_id, MessageType type, const void* data,
+                                   size_t len, bool first, bool last);
+
+  // connection_memory reserves a fixed arena per connection, up front, for all receive and send buffers, so that
+  // no heap allocations are made from lwIP context. Messages that don't fit are rejected (the connection is
+  // closed with status 1009, or the send fails). The default of 0 allocates from the heap as needed instead.
+  WebSocketServer(uint32_t max_connections = 1, size_t connection_memory = 0);
   ~WebSocketServer();
 
   // Warning: connect/close callbacks may be called from cyw43 ISR context, use caution with shared data
@@ -26,8 +102,19 @@ class WebSocketServer {
   // Note: unlike connect/close, the message callback will not be called from an ISR, but still holds
   // the cyw43 context lock
   void setMessageCallback(MessageCallback cb);
+#if PICO_WS_SERVER_PING
   // PONG callback runs in the same context as message callback (cyw43 lock held, not ISR)
   void setPongCallback(PongCallback cb);
+#endif
+  // Opt-in zero-copy receive: when set, TEXT/BINARY messages are delivered to this callback instead of the
+  // message callback, as views over the received pbufs (unmasked in place). Runs in the same context as the
+  // message callback.
+  void setMessageViewCallback(MessageViewCallback cb);
+  // Streaming receive: when set, TEXT/BINARY messages are passed to this callback chunk by chunk as they arrive,
+  // instead of being reassembled (takes precedence over the message and message view callbacks). Messages are
+  // never buffered, so there is no limit on message size.
+  // Warning: like connect/close, the fragment callback may be called from cyw43 ISR context
+  void setFragmentCallback(FragmentCallback cb);
   void setCallbackExtra(void* arg);
   void* getCallbackExtra();
 
@@ -40,23 +127,216 @@ class WebSocketServer {
   // Default is false (Nagle's algorithm enabled).
   void setTcpNoDelay(bool enabled);
 
+  // Cork sends on all connections: frames sent between beginBatch() and endBatch() are packed together, and each
+  // connection is flushed once at the end, so several small messages share TCP segments. Batches may be nested,
+  // only the outermost endBatch() flushes.
+  void beginBatch();
+  void endBatch();
+
+  // Scope for a group of sends from application code (not from callbacks, which already run in lwIP context). It
+  // holds the cyw43 lock once for its lifetime, so calls made through it skip the per-call locking, and it batches
+  // them (see beginBatch) so each connection is flushed once when it ends. Calls on the server itself remain
+  // allowed within the scope. For example:
+  //   server.batch([&](WebSocketServer::Batch& b) {
+  //     for (uint32_t id : clients) b.send(id, update, sizeof(update));
+  //   });
+  class Batch {
+   public:
+    explicit Batch(WebSocketServer& server);
+    ~Batch();
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    // Equivalent to the server methods of the same name
+    bool send(uint32_t conn_id, const char* payload);
+    bool send(uint32_t conn_id, const void* payload, size_t payload_size);
+    bool sendV(uint32_t conn_id, MessageType type, const Segment* parts, size_t count);
+    bool sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                    MessageType type = BINARY);
+    bool sendPrepared(uint32_t conn_id, FrameHandle handle);
+#if PICO_WS_SERVER_PING
+    bool ping(uint32_t conn_id, const void* payload = nullptr, size_t payload_size = 0);
+#endif
+#if PICO_WS_SERVER_BROADCAST
+    bool broadcast(const char* payload, uint32_t* failed_slots = nullptr);
+    bool broadcast(const void* payload, size_t payload_size, uint32_t* failed_slots = nullptr);
+    bool publish(uint32_t topic, const char* payload, uint32_t* failed_slots = nullptr);
+    bool publish(uint32_t topic, const void* payload, size_t payload_size, uint32_t* failed_slots = nullptr);
+#endif
+    bool close(uint32_t conn_id);
+
+   private:
+    WebSocketServerInternal& internal;
+  };
+  // Runs fn(Batch&) within a Batch scope
+  template <typename Fn>
+  void batch(Fn&& fn) {
+    Batch scope(*this);
+    fn(scope);
+  }
+
+  // Batch the sends made from callbacks during each popMessages() call. Default is false, sends are flushed
+  // immediately (as suits latency-sensitive apps using setTcpNoDelay).
+  void setAutoBatch(bool enabled);
+
+#if PICO_WS_SERVER_PING
+  // Keepalive: a PING is sent to each connection that has been quiet (nothing received) for interval_ms, and one
+  // that stays quiet for max_missed PINGs in a row is aborted, freeing its slot. 0 disables (the default).
+  void setKeepalive(uint32_t interval_ms, uint32_t max_missed = 3);
+#endif
+  // Close connections that haven't received a message for timeout_ms (PINGs/PONGs don't count). Upgraded
+  // connections are closed with status 1001 (Going Away), and aborted if the close doesn't complete in time.
+  // 0 disables (the default).
+  void setIdleTimeout(uint32_t timeout_ms);
+
+  // Each connection queues received messages for popMessages() in a fixed ring of capacity slots, reserved for
+  // every connection in startListening() (call this first). Messages of up to 47 bytes are stored inline in their
+  // slot, so receiving them never allocates.
+  // Default is 16 slots with STOP_READING.
+  void setMessageQueue(size_t capacity, QueueOverflowPolicy policy);
+
+  // Server-wide limit on memory held by received messages (reassembled, or retained as views) across all
+  // connections. Each frame's announced length is reserved before its payload is read, and released once the
+  // message has been delivered (or for views, released). A frame larger than the whole budget is always rejected.
+  // With DELAY_RECEIVE, a fragmented message is only held back before its first frame, and may overrun the budget
+  // once started. Default is 0 (unlimited).
+  void setReceiveBudget(size_t bytes, ReceiveBudgetPolicy policy);
+
+  // Once a connection is upgraded, frames that lwIP can't accept yet (send buffer full) are copied into a
+  // per-connection queue, from the connection arena, and sent as the peer acknowledges data. Sends only fail once
+  // max_bytes are queued. high_cb is called when the queue grows to high_watermark bytes, then low_cb once it has
+  // drained to low_watermark, so producers can back off. Zero-copy sends fail while anything is queued.
+  // Default max_bytes is 0 (disabled, sends fail as soon as lwIP can't accept them).
+  void setSendQueue(size_t max_bytes, size_t high_watermark, size_t low_watermark);
+  // Warning: like connect/close, these may be called from cyw43 ISR context
+  void setSendQueueCallbacks(SendQueueCallback high_cb, SendQueueCallback low_cb);
+
   // Send a TEXT message, payload must be a null-terminated string
   bool sendMessage(uint32_t conn_id, const char* payload);
   // Send a BINARY message
   bool sendMessage(uint32_t conn_id, const void* payload, size_t payload_size);
+  // Send a message gathered from several parts, in order, without concatenating them into a buffer first.
+  // Fails if the send buffer can't take the whole message, rather than sending part of it.
+  bool sendMessageV(uint32_t conn_id, MessageType type, const Segment* parts, size_t count);
+  // Send a message of total_size bytes (not limited by the send buffer), pulled from producer as the send buffer
+  // frees up. With fragment_size, the message is split into frames of at most that many bytes. Only one stream
+  // may be in progress per connection, and other sends on it are queued behind the stream (see setSendQueue).
+  // Warning: like connect/close, producer and done_cb may be called from cyw43 ISR context
+  bool sendMessageStream(uint32_t conn_id, MessageType type, size_t total_size, StreamProducer producer,
+                         StreamCompleteCallback done_cb, void* arg = nullptr, size_t fragment_size = 0);
+  // Send a message in fragments as the data is produced, with constant memory: beginMessage starts it, each
+  // appendMessage sends a fragment (copied, so data may be reused once it returns), and endMessage finishes it.
+  // Only one may be open per connection. Other messages sent on the connection meanwhile are queued until it ends
+  // (see setSendQueue), control frames may go between fragments. A failed append or end may be retried.
+  bool beginMessage(uint32_t conn_id, MessageType type = BINARY);
+  bool appendMessage(uint32_t conn_id, const void* payload, size_t payload_size);
+  bool endMessage(uint32_t conn_id);
+  // Send the latest value for a state stream (e.g. a sensor reading) through conflation slot slot_id, from 0 to
+  // PICO_WS_SERVER_LATEST_SLOTS - 1. A value that hasn't been sent yet is replaced by the newer one, and pending
+  // slots are sent round-robin as the send buffer frees up, so at most one value per slot is ever buffered. Values
+  // wait for a stream or fragmented message that is partly sent to finish.
+  bool sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                  MessageType type = BINARY);
+  // Encode a message once, for any number of sendPrepared/broadcastPrepared calls without encoding or copying it
+  // again. The frame is immutable and reference counted: connections still sending it keep it alive after
+  // releasePrepared. Returns nullptr if out of memory.
+  FrameHandle prepareMessage(MessageType type, const void* payload, size_t payload_size);
+  // As above, for a frame that is already encoded (e.g. with encodeFrame, into constant data in flash). The frame is
+  // not copied, and must remain valid for as long as the server may send it.
+  FrameHandle prepareEncodedMessage(const void* frame, size_t frame_size);
+  void releasePrepared(FrameHandle handle);
+  bool sendPrepared(uint32_t conn_id, FrameHandle handle);
+
+  // Size of the header of an unfragmented frame (sent by a server, so unmasked) with payload_size bytes of payload
+  static constexpr size_t frameHeaderSize(size_t payload_size) {
+    return payload_size <= 125 ? 2 : payload_size <= UINT16_MAX ? 4 : 10;
+  }
+  // Encodes the header of an unfragmented frame, returning its size (see frameHeaderSize)
+  static constexpr size_t encodeFrameHeader(MessageType type, size_t payload_size, uint8_t* header_out) {
+    const size_t header_size = frameHeaderSize(payload_size);
+    header_out[0] = 0x80 | type;
+    header_out[1] = header_size == 2 ? payload_size : header_size == 4 ? 126 : 127;
+    for (size_t i = 2; i < header_size; i++) {
+      header_out[i] = (uint64_t)payload_size >> (8 * (header_size - 1 - i));
+    }
+    return header_size;
+  }
+  // Encodes a complete frame at compile time, for prepareEncodedMessage. For example:
+  //   static constexpr auto HELLO = WebSocketServer::encodeFrame(WebSocketServer::TEXT, "hello");
+  //   FrameHandle hello = server.prepareEncodedMessage(HELLO.data(), HELLO.size());
+  // String literals are sent without their NULL terminator.
+  template <size_t N>
+  static constexpr std::array<uint8_t, frameHeaderSize(N - 1) + N - 1> encodeFrame(MessageType type,
+                                                                                 const char (&payload)[N]) {
+    std::array<uint8_t, frameHeaderSize(N - 1) + N - 1> frame{};
+    const size_t header_size = encodeFrameHeader(type, N - 1, frame.data());
+    for (size_t i = 0; i + 1 < N; i++) {
+      frame[header_size + i] = payload[i];
+    }
+    return frame;
+  }
+  template <size_t N>
+  static constexpr std::array<uint8_t, frameHeaderSize(N) + N> encodeFrame(MessageType type,
+                                                                         const std::array<uint8_t, N>& payload) {
+    std::array<uint8_t, frameHeaderSize(N) + N> frame{};
+    const size_t header_size = encodeFrameHeader(type, N, frame.data());
+    for (size_t i = 0; i < N; i++) {
+      frame[header_size + i] = payload[i];
+    }
+    return frame;
+  }
+
+  // Send a message without copying the payload, which lwIP references directly until it has been acknowledged by
+  // the peer. The payload must remain valid and unchanged until done_cb is called (once, unless this returns false).
+  // Fails if the send buffer can't take the whole message, rather than sending part of it.
+  // Warning: like connect/close, done_cb may be called from cyw43 ISR context
+  bool sendMessageZeroCopy(uint32_t conn_id, const void* payload, size_t payload_size, SendCompleteCallback done_cb,
+                           MessageType type = BINARY);
+
+#if PICO_WS_SERVER_PING
   // Send a PING control frame, optional payload echoed back in PONG (up to 125 bytes per RFC)
   bool sendPing(uint32_t conn_id, const void* payload = nullptr, size_t payload_size = 0);
+#endif
 
+#if PICO_WS_SERVER_BROADCAST
+  // Broadcasts encode the frame once, and share it between connections (without copying where lwIP allows, for frames
+  // larger than PICO_WS_SERVER_SHARED_FRAME_COPY_SIZE).
+  // Returns true if every upgraded connection accepted the message. If failed_slots is given, it must have room
+  // for (max_connections + 31) / 32 words: bit n is set if the send to the connection in slot n failed.
   // Send a TEXT message to all connections, payload must be a null-terminated string
-  bool broadcastMessage(const char* payload);
+  bool broadcastMessage(const char* payload, uint32_t* failed_slots = nullptr);
   // Send a BINARY message to all connections
-  bool broadcastMessage(const void* payload, size_t payload_size);
+  bool broadcastMessage(const void* payload, size_t payload_size, uint32_t* failed_slots = nullptr);
+  // Send a prepared message (see prepareMessage) to all connections
+  bool broadcastPrepared(FrameHandle handle, uint32_t* failed_slots = nullptr);
+
+  // Groups of connections, numbered from 0 to PICO_WS_SERVER_MAX_TOPICS - 1. Connections are unsubscribed from
+  // everything when they close.
+  bool subscribe(uint32_t conn_id, uint32_t topic);
+  bool unsubscribe(uint32_t conn_id, uint32_t topic);
+  // Send a message to the subscribers of topic, encoded once like broadcastMessage. Returns true if every subscriber
+  // accepted it (including when there are none).
+  bool publish(uint32_t topic, const char* payload, uint32_t* failed_slots = nullptr);
+  bool publish(uint32_t topic, const void* payload, size_t payload_size, uint32_t* failed_slots = nullptr);
+  bool publishPrepared(uint32_t topic, FrameHandle handle, uint32_t* failed_slots = nullptr);
+#endif
+  // Slots number connections from 0 to max_connections - 1, and are reused once a connection closes (the
+  // connection ID of a reused slot is still different)
+  bool getConnectionSlot(uint32_t conn_id, uint32_t* slot);
+#if PICO_WS_SERVER_RTT
+  // Copies the connection's round-trip time stats. PINGs sent without a payload (by sendPing or keepalive) carry
+  // a sequence number and timestamp, which the PONG echoes back.
+  bool getConnectionStats(uint32_t conn_id, ConnectionStats* stats);
+#endif
 
   // Begin closing the specified connection.
   // Note: it is still possible for messages to be received on a closing connection,
   // but no further messages may be sent.
   bool close(uint32_t conn_id);
 
+  // Release a message delivered to the message view callback, either from within the callback or later
+  void releaseMessage(void* release_handle);
+
  private:
   std::unique_ptr<WebSocketServerInternal> internal;
   void* callback_extra = nullptr;
@@ -2,36 +2,297 @@
 
 #include <cstddef>
 #include <string.h>
-#include <queue>
 
 #include "cyw43_config.h"
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#if PICO_WS_SERVER_RTT
+#include "pico/time.h"
+#endif
 
+#include "pico_ws_server/config.h"
+#include "debug.h"
+#include "shared_frame.h"
 #include "web_socket_message.h"
 #include "web_socket_server_internal.h"
 
-void ClientConnection::popMessages() {
+namespace {
+
+// Completion for shared frames sent without a copy, drops the connection's reference
+void release_shared_frame(WebSocketServer&, uint32_t, const void* frame, bool) {
+  ((SharedFrame*)frame)->release();
+}
+
+// Shorter of two intervals, where 0 is disabled
+uint32_t sooner(uint32_t a, uint32_t b) {
+  return !a ? b : !b ? a : a < b ? a : b;
+}
+
+#if PICO_WS_SERVER_RTT
+// See WebSocketServer::ConnectionStats::rtt_histogram
+size_t rtt_bucket(uint32_t rtt_us) {
+  constexpr size_t last = WebSocketServer::ConnectionStats::RTT_BUCKETS - 1;
+  const uint32_t scaled = rtt_us >> 7;
+  const size_t bucket = scaled ? 32 - __builtin_clz(scaled) : 0;
+  return bucket < last ? bucket : last;
+}
+#endif
+
+} // namespace
+
+ClientConnection::~ClientConnection() {
+  server.cancelTimer(timer);
+  // The queue is reused by the next connection in this slot
+  message_queue.clear();
+  server.releaseReceive(receive_reserved);
+  if (pending_input) {
+    pbuf_free(pending_input);
+  }
+}
+
+bool ClientConnection::popMessages() {
   while (!message_queue.empty()) {
-    server.onMessage(this, message_queue.front().getPayload(), message_queue.front().getPayloadSize());
+    WebSocketMessage& message = message_queue.front();
+    size_t size = message.getPayloadSize();
+    if (message.hasView()) {
+      // The server takes over the view's share of the receive budget, until it is released
+      receive_reserved -= size;
+      server.onMessageView(this, message.releaseView());
+    } else {
+      server.onMessage(this, message.getPayload(), size);
+      releaseReceive(size);
+    }
     message_queue.pop();
   }
+
+  if (pending_input) {
+    // There is room in the queue again, pick up where receive was paused
+    return processInput(pending_input, pending_offset);
+  }
+  return true;
 }
 
 bool ClientConnection::process(struct pbuf* pb) {
+  // Any input shows the peer is alive, so keepalive PINGs are only sent to quiet connections
+  liveness_tick = server.getTimerTick();
+  unanswered_pings = 0;
+
+  if (pending_input) {
+    // Keep the input in order behind what was held back
+    pbuf_cat(pending_input, pb);
+    return processInput(pending_input, pending_offset);
+  }
+
+  return processInput(pb, 0);
+}
+
+bool ClientConnection::processInput(struct pbuf* pb, size_t offset) {
+  size_t consumed = offset;
   bool result;
   if (http_handler.isUpgraded()) {
-    result = ws_handler.process(pb);
+    result = ws_handler.process(pb, &consumed);
   } else {
     result = http_handler.process(pb);
+    consumed = pb->tot_len;
     if (http_handler.isUpgraded()) {
+      last_message_tick = server.getTimerTick();
       server.onUpgrade(this);
     }
   }
 
+  // Only acknowledge what was consumed, so the receive window closes while paused
+  tcp_recved(pcb, consumed - offset);
+
+  if (result && consumed < pb->tot_len) {
+    pending_input = pb;
+    pending_offset = consumed;
+    return true;
+  }
+
+  pbuf_free(pb);
+  pending_input = nullptr;
+  pending_offset = 0;
   return result;
 }
 
+bool ClientConnection::canWrite(size_t size, size_t pbufs) {
+  const size_t reserved_pbufs = http_handler.isUpgraded() ? CONTROL_PBUFS : 0;
+  return getDataSendBuffer() >= size && tcp_sndqueuelen(pcb) + pbufs + reserved_pbufs <= TCP_SND_QUEUELEN;
+}
+
+size_t ClientConnection::getDataWriteSize(size_t size) {
+  // A copied write of n bytes is estimated at n / mss + 2 pbufs (as in sendRaw), so limit the chunk to the pbufs
+  // left after the control frame reserve
+  const size_t reserved_pbufs = http_handler.isUpgraded() ? CONTROL_PBUFS : 0;
+  const size_t queued_pbufs = tcp_sndqueuelen(pcb) + reserved_pbufs + 2;
+  if (queued_pbufs > TCP_SND_QUEUELEN) {
+    return 0;
+  }
+  const size_t max_size = (TCP_SND_QUEUELEN - queued_pbufs + 1) * tcp_mss(pcb) - 1;
+  if (size > max_size) {
+    size = max_size;
+  }
+  if (size > getDataSendBuffer()) {
+    size = getDataSendBuffer();
+  }
+  // tcp_write takes at most UINT16_MAX bytes at a time
+  if (size > UINT16_MAX) {
+    size = UINT16_MAX;
+  }
+  return size;
+}
+
+size_t ClientConnection::getDataSendBuffer() {
+  const size_t available = tcp_sndbuf(pcb);
+  if (!http_handler.isUpgraded()) {
+    return available;
+  }
+  return available > CONTROL_HEADROOM ? available - CONTROL_HEADROOM : 0;
+}
+
+bool ClientConnection::isAtFrameBoundary() {
+  return !send_queue.isFrontStarted() && !(send_stream.producer && send_stream.frame_remaining);
+}
+
+bool ClientConnection::sendControlFrame(const void* data, size_t size) {
+  cyw43_arch_lwip_check();
+
+  if (size > MAX_CONTROL_FRAME_SIZE) {
+    return false;
+  }
+
+  if (!control_count && isAtFrameBoundary() && writeControlFrame((const uint8_t*)data, size)) {
+    return true;
+  }
+
+  if (control_count == PICO_WS_SERVER_CONTROL_QUEUE_SIZE) {
+    DEBUG("control queue full");
+    return false;
+  }
+  ControlFrame& frame = control_frames[(control_head + control_count) % PICO_WS_SERVER_CONTROL_QUEUE_SIZE];
+  frame.size = size;
+  memcpy(frame.data, data, size);
+  control_count++;
+  return true;
+}
+
+bool ClientConnection::writeControlFrame(const uint8_t* data, size_t size) {
+  const uint8_t more = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+  if (tcp_write(pcb, data, size, TCP_WRITE_FLAG_COPY | more) != ERR_OK) {
+    return false;
+  }
+  bytes_written += size;
+
+  // Nothing may follow a CLOSE, so data frames that haven't started are dropped
+  if ((data[0] & 0x0F) == WebSocketMessage::CLOSE) {
+    send_queue.clear();
+    held_queue.clear();
+    outbound_message = {};
+    clearLatest();
+    if (send_stream.producer) {
+      send_stream.producer = nullptr;
+      server.onSendStreamComplete(this, send_stream.done_cb, send_stream.arg, false);
+    }
+  }
+  return true;
+}
+
+bool ClientConnection::sendWebSocketLatest(uint32_t slot_id, const void* payload, size_t size,
+                                           WebSocketServer::MessageType type) {
+  cyw43_arch_lwip_check();
+
+  if (!http_handler.isUpgraded() || ws_handler.isClosing()) {
+    return false;
+  }
+  if (slot_id >= PICO_WS_SERVER_LATEST_SLOTS || size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+  // Encode into the slot, replacing any value that hasn't been sent yet
+  LatestSlot& latest = latest_slots[slot_id];
+  uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+  const size_t header_len = ws_handler.makeFrameHeader(/*final=*/true, type, size, header);
+  if (!latest.frame.resize(header_len + size)) {
+    DEBUG("out of memory");
+    return false;
+  }
+  memcpy(latest.frame.data(), header, header_len);
+  if (size) {
+    memcpy(latest.frame.data() + header_len, payload, size);
+  }
+  if (!latest.pending) {
+    latest.pending = true;
+    latest_pending++;
+  }
+
+  drainSendQueue();
+  return true;
+}
+
+bool ClientConnection::drainLatest() {
+  bool written = false;
+  for (size_t i = 0; i < PICO_WS_SERVER_LATEST_SLOTS && latest_pending && isAtFrameBoundary(); i++) {
+    LatestSlot& latest = latest_slots[latest_next];
+    if (latest.pending) {
+      if (!writeLatest(latest)) {
+        break;
+      }
+      written = true;
+    }
+    latest_next = (latest_next + 1) % PICO_WS_SERVER_LATEST_SLOTS;
+  }
+  return written;
+}
+
+bool ClientConnection::writeLatest(LatestSlot& latest) {
+  const size_t size = latest.frame.getSize();
+  if (!canWrite(size, size / tcp_mss(pcb) + 2)) {
+    return false;
+  }
+
+  const uint8_t more = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+  if (tcp_write(pcb, latest.frame.data(), size, TCP_WRITE_FLAG_COPY | more) != ERR_OK) {
+    return false;
+  }
+  bytes_written += size;
+
+  latest.frame.reset();
+  latest.pending = false;
+  latest_pending--;
+  return true;
+}
+
+void ClientConnection::clearLatest() {
+  for (LatestSlot& latest : latest_slots) {
+    latest.frame.reset();
+    latest.pending = false;
+  }
+  latest_pending = 0;
+}
+
+bool ClientConnection::drainControlFrames() {
+  bool written = false;
+  while (control_count && isAtFrameBoundary()) {
+    const ControlFrame& frame = control_frames[control_head];
+    if (!writeControlFrame(frame.data, frame.size)) {
+      break;
+    }
+    control_head = (control_head + 1) % PICO_WS_SERVER_CONTROL_QUEUE_SIZE;
+    control_count--;
+    written = true;
+  }
+  return written;
+}
+
+bool ClientConnection::flushControlFrames() {
+  if (!control_count || ws_handler.isAbandoned()) {
+    return false;
+  }
+
+  drainSendQueue();
+  return !control_count;
+}
+
 bool ClientConnection::sendRaw(const void* data, size_t size) {
   cyw43_arch_lwip_check();
 
@@ -39,33 +300,386 @@ bool ClientConnection::sendRaw(const void* data, size_t size) {
     return true;
   }
 
+  // Messages can't be split by an open fragmented message
+  if (outbound_message.open) {
+    return queueFrame(held_queue, data, size, nullptr, 0);
+  }
+  // Frames queued earlier (or a stream in progress) must go first
+  if (hasQueuedSends() || !canWrite(size, size / tcp_mss(pcb) + 2)) {
+    return queueFrame(send_queue, data, size, nullptr, 0);
+  }
+
   // Note: unfortunately, we cannot easily determine whether ERR_MEM should be retryable here. It could be a
   // transient problem that would resolve over time, e.g. if the remote side acks some data and frees up send buffer.
   // Or, this payload (and the downstream structures needed) may be too large to ever fit in the LwIP pools.
   //
-  // At best, we could return a "maybe retriable" status here, since we know some errors are permanent. However,
-  // this would add complexity, and would still leave callers with the burden of non-convergent retries.
+  // Once upgraded, failed frames are held in the send queue (if enabled) and retried as data is acknowledged, up to
+  // its size limit. That bounds the retries, rather than leaving callers to retry indefinitely.
   //
   // Use TCP_WRITE_FLAG_COPY to copy data, and omit TCP_WRITE_FLAG_MORE to signal this is complete data
   // that should be pushed immediately (sets PSH flag)
-  return tcp_write(pcb, data, size, TCP_WRITE_FLAG_COPY) == ERR_OK;
+  // While batching, frames are packed with TCP_WRITE_FLAG_MORE and pushed once the batch ends.
+  const uint8_t more = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+  if (tcp_write(pcb, data, size, TCP_WRITE_FLAG_COPY | more) != ERR_OK) {
+    return queueFrame(send_queue, data, size, nullptr, 0);
+  }
+  bytes_written += size;
+  return true;
+}
+
+bool ClientConnection::sendRawZeroCopy(const void* header, size_t header_size, const void* payload, size_t size) {
+  WebSocketServer::Segment part = {payload, size};
+  return writeFrame(header, header_size, &part, 1, /*payload_flags=*/0);
+}
+
+bool ClientConnection::sendRawV(const void* header, size_t header_size, const WebSocketServer::Segment* parts,
+                                size_t count) {
+  return writeFrame(header, header_size, parts, count, TCP_WRITE_FLAG_COPY);
+}
+
+bool ClientConnection::writeFrame(const void* header, size_t header_size, const WebSocketServer::Segment* parts,
+                                  size_t count, uint8_t payload_flags, bool fragment) {
+  cyw43_arch_lwip_check();
+
+  // Check for room up front, so a frame is never left half written. Each write may start a new segment, and
+  // without TCP_WRITE_FLAG_COPY each segment takes a header pbuf plus a pbuf referencing the data.
+  const size_t pbufs_per_segment = (payload_flags & TCP_WRITE_FLAG_COPY) ? 1 : 2;
+  size_t size = header_size;
+  size_t pbufs = 1;
+  for (size_t i = 0; i < count; i++) {
+    size += parts[i].len;
+    pbufs += pbufs_per_segment * (parts[i].len / tcp_mss(pcb) + 2);
+  }
+  const bool held = outbound_message.open && !fragment;
+  if (held || hasQueuedSends() || !canWrite(size, pbufs)) {
+    // Only copied frames can wait in the send queue
+    if (payload_flags & TCP_WRITE_FLAG_COPY) {
+      return queueFrame(held ? held_queue : send_queue, header, header_size, parts, count);
+    }
+    return false;
+  }
+
+  size_t remaining = size - header_size;
+  const uint8_t more = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+  if (header_size &&
+      tcp_write(pcb, header, header_size, TCP_WRITE_FLAG_COPY | (remaining ? TCP_WRITE_FLAG_MORE : more)) != ERR_OK) {
+    // Nothing has been written yet, so a copied frame can still wait in the queue
+    if (payload_flags & TCP_WRITE_FLAG_COPY) {
+      return queueFrame(held ? held_queue : send_queue, header, header_size, parts, count);
+    }
+    return false;
+  }
+  bytes_written += header_size;
+
+  for (size_t i = 0; i < count; i++) {
+    // tcp_write takes at most UINT16_MAX bytes at a time
+    const uint8_t* data = (const uint8_t*)parts[i].data;
+    size_t len = parts[i].len;
+    while (len) {
+      uint16_t chunk = len > UINT16_MAX ? UINT16_MAX : len;
+      len -= chunk;
+      remaining -= chunk;
+      if (tcp_write(pcb, data, chunk, payload_flags | (remaining ? TCP_WRITE_FLAG_MORE : more)) != ERR_OK) {
+        // Part of the frame is already queued, so the stream can't be recovered
+        DEBUG("failed to write payload, abandoning connection");
+        ws_handler.abandon();
+        return false;
+      }
+      bytes_written += chunk;
+      data += chunk;
+    }
+  }
+  return true;
+}
+
+bool ClientConnection::queueFrame(SendQueue& queue, const void* header, size_t header_size,
+                                  const WebSocketServer::Segment* parts, size_t count) {
+  if (!http_handler.isUpgraded()) {
+    return false;
+  }
+
+  size_t size = header_size;
+  for (size_t i = 0; i < count; i++) {
+    size += parts[i].len;
+  }
+  const size_t queued = send_queue.size() + held_queue.size();
+  if (queued + size > server.getSendQueueLimit()) {
+    DEBUG("send queue full");
+    return false;
+  }
+  if (!queue.push(header, header_size, parts, count)) {
+    DEBUG("out of memory");
+    return false;
+  }
+
+  if (!send_queue_congested && queued + size >= server.getSendQueueHighWatermark()) {
+    send_queue_congested = true;
+    server.onSendQueueHigh(this, queued + size);
+  }
+  return true;
+}
+
+void ClientConnection::drainSendQueue() {
+  cyw43_arch_lwip_check();
+
+  // Control frames go first, then the stream, and frames queued during a stream follow it
+  bool written = drainControlFrames();
+  // Conflated values wait for an open fragmented message or a started stream to end, like other messages (the stream
+  // may pause between fragments, where only control frames may go)
+  if (!control_count && !outbound_message.open && !(send_stream.producer && send_stream.started)) {
+    written |= drainLatest();
+  }
+  if (send_stream.producer && !control_count) {
+    written |= pumpSendStream();
+  }
+  const uint8_t more = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+  while (!send_stream.producer && !send_queue.empty()) {
+    if (control_count && isAtFrameBoundary()) {
+      written |= drainControlFrames();
+      if (control_count) {
+        break;
+      }
+      continue;
+    }
+
+    const size_t size = getDataWriteSize(send_queue.frontSize());
+    // Push (omit TCP_WRITE_FLAG_MORE) once the queue is empty, unless batching
+    uint8_t flags = TCP_WRITE_FLAG_COPY | (size < send_queue.size() ? TCP_WRITE_FLAG_MORE : more);
+    if (!size || tcp_write(pcb, send_queue.frontData(), size, flags) != ERR_OK) {
+      break;
+    }
+    bytes_written += size;
+    send_queue.consume(size);
+    written = true;
+  }
+
+  if (written) {
+    flushSend();
+  }
+
+  const size_t queued = send_queue.size() + held_queue.size();
+  if (send_queue_congested && queued <= server.getSendQueueLowWatermark()) {
+    send_queue_congested = false;
+    server.onSendQueueLow(this, queued);
+  }
+}
+
+bool ClientConnection::pumpSendStream() {
+  SendStream& stream = send_stream;
+  bool written = false;
+  const uint8_t batched = server.isSendBatched() ? TCP_WRITE_FLAG_MORE : 0;
+
+  while (stream.producer) {
+    if (!stream.frame_remaining && control_count) {
+      // Control frames may go between fragments (a CLOSE ends the stream)
+      written |= drainControlFrames();
+      if (control_count) {
+        break;
+      }
+      continue;
+    }
+
+    if (!stream.frame_remaining && (stream.offset < stream.total_size || !stream.started)) {
+      size_t size = stream.total_size - stream.offset;
+      if (stream.fragment_size && size > stream.fragment_size) {
+        size = stream.fragment_size;
+      }
+      const bool final = stream.offset + size == stream.total_size;
+      const uint8_t opcode = stream.started ? WebSocketHandler::OPCODE_CONTINUATION : stream.type;
+
+      uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+      const size_t header_len = ws_handler.makeFrameHeader(final, opcode, size, header);
+      if (!canWrite(header_len, 1) ||
+          tcp_write(pcb, header, header_len, TCP_WRITE_FLAG_COPY | (size ? TCP_WRITE_FLAG_MORE : batched)) != ERR_OK) {
+        break;
+      }
+      bytes_written += header_len;
+      written = true;
+      stream.started = true;
+      stream.frame_remaining = size;
+    }
+
+    if (!stream.frame_remaining) {
+      // Everything has been handed to lwIP. Clear the stream first, done_cb may start another.
+      SendStream done = stream;
+      stream.producer = nullptr;
+      server.onSendStreamComplete(this, done.done_cb, done.arg, true);
+      continue;
+    }
+
+    const size_t max_size = getDataWriteSize(stream.frame_remaining);
+    if (!max_size) {
+      break;
+    }
+
+    const void* data = nullptr;
+    size_t size = server.pullSendStream(this, stream.producer, stream.offset, max_size, &data, stream.arg);
+    if (!size || !data) {
+      // Nothing ready, try again on the next acknowledgement or poll
+      break;
+    }
+    if (size > max_size) {
+      size = max_size;
+    }
+
+    // On failure (e.g. the send queue length limit), the same offset is pulled again later
+    const bool more = stream.offset + size < stream.total_size;
+    if (tcp_write(pcb, data, size, TCP_WRITE_FLAG_COPY | (more ? TCP_WRITE_FLAG_MORE : batched)) != ERR_OK) {
+      break;
+    }
+    bytes_written += size;
+    written = true;
+    stream.offset += size;
+    stream.frame_remaining -= size;
+  }
+
+  return written;
+}
+
+bool ClientConnection::sendWebSocketStream(WebSocketServer::MessageType type, size_t total_size,
+                                           WebSocketServer::StreamProducer producer,
+                                           WebSocketServer::StreamCompleteCallback done_cb, void* arg,
+                                           size_t fragment_size) {
+  if (!http_handler.isUpgraded() || ws_handler.isClosing() || !producer) {
+    return false;
+  }
+
+  // Queued frames would have to go first, and can't be interleaved with the stream's frames
+  if (hasQueuedSends() || outbound_message.open) {
+    DEBUG("send in progress");
+    return false;
+  }
+
+  send_stream = {};
+  send_stream.producer = producer;
+  send_stream.done_cb = done_cb;
+  send_stream.arg = arg;
+  send_stream.type = type;
+  send_stream.total_size = total_size;
+  send_stream.fragment_size = fragment_size;
+
+  drainSendQueue();
+  return true;
+}
+
+bool ClientConnection::beginWebSocketMessage(WebSocketServer::MessageType type) {
+  cyw43_arch_lwip_check();
+
+  if (!http_handler.isUpgraded() || ws_handler.isClosing()) {
+    return false;
+  }
+  if (outbound_message.open) {
+    DEBUG("message already in progress");
+    return false;
+  }
+
+  // Nothing is written until the first fragment, so an empty message is a single frame
+  outbound_message = {/*open=*/true, /*started=*/false, (uint8_t)type};
+  return true;
+}
+
+bool ClientConnection::appendWebSocketMessage(const void* payload, size_t size) {
+  cyw43_arch_lwip_check();
+
+  if (!outbound_message.open || ws_handler.isClosing()) {
+    return false;
+  }
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+  if (!size) {
+    return true;
+  }
+
+  return writeFragment(/*final=*/false, payload, size);
+}
+
+bool ClientConnection::endWebSocketMessage() {
+  cyw43_arch_lwip_check();
+
+  if (!outbound_message.open || ws_handler.isClosing()) {
+    return false;
+  }
+
+  if (!writeFragment(/*final=*/true, nullptr, 0)) {
+    return false;
+  }
+
+  // Sends held back while the message was open follow it, in order
+  outbound_message = {};
+  send_queue.splice(held_queue);
+  drainSendQueue();
+  return true;
+}
+
+bool ClientConnection::writeFragment(bool final, const void* payload, size_t size) {
+  const uint8_t opcode = outbound_message.started ? WebSocketHandler::OPCODE_CONTINUATION : outbound_message.type;
+  uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+  const size_t header_len = ws_handler.makeFrameHeader(final, opcode, size, header);
+
+  // Written in full or queued, like any other frame, so control frames may still go between fragments
+  WebSocketServer::Segment part = {payload, size};
+  if (!writeFrame(header, header_len, &part, size ? 1 : 0, TCP_WRITE_FLAG_COPY, /*fragment=*/true)) {
+    return false;
+  }
+  outbound_message.started = true;
+
+  // Fragments are pushed as they are appended, for a low time to first byte
+  flushSend();
+  return true;
 }
 
 bool ClientConnection::flushSend() {
   cyw43_arch_lwip_check();
 
+  if (server.isSendBatched()) {
+    flush_pending = true;
+    return true;
+  }
   return tcp_output(pcb) == ERR_OK;
 }
 
-bool ClientConnection::needsSentCallback() {
-  return http_handler.needsSentCallback();
+bool ClientConnection::flushBatch() {
+  cyw43_arch_lwip_check();
+
+  if (!flush_pending) {
+    return true;
+  }
+  flush_pending = false;
+  return tcp_output(pcb) == ERR_OK;
 }
 
 bool ClientConnection::onSent(uint16_t len) {
+  bytes_acked += len;
+  while (zero_copy_count && (int32_t)(bytes_acked - zero_copy_sends[zero_copy_head].end) >= 0) {
+    completeZeroCopySend(true);
+  }
+
+  if (hasPendingSends()) {
+    drainSendQueue();
+  }
+
+  if (!http_handler.needsSentCallback()) {
+    return true;
+  }
   return http_handler.onSent(len);
 }
 
+void ClientConnection::completeZeroCopySend(bool success) {
+  ZeroCopySend send = zero_copy_sends[zero_copy_head];
+  zero_copy_head = (zero_copy_head + 1) % PICO_WS_SERVER_MAX_ZERO_COPY_SENDS;
+  zero_copy_count--;
+  server.onSendComplete(this, send.payload, send.done_cb, success);
+}
+
 void ClientConnection::onClose() {
+  if (send_stream.producer) {
+    send_stream.producer = nullptr;
+    server.onSendStreamComplete(this, send_stream.done_cb, send_stream.arg, false);
+  }
+  while (zero_copy_count) {
+    completeZeroCopySend(false);
+  }
   server.onClose(this, http_handler.isUpgraded());
 }
 
@@ -73,14 +687,69 @@ bool ClientConnection::isClosing() {
   return http_handler.isClosing() || ws_handler.isClosing();
 }
 
+bool ClientConnection::isUpgraded() {
+  return http_handler.isUpgraded();
+}
+
+bool ClientConnection::isZeroCopyReceive() {
+  return server.isZeroCopyReceive();
+}
+
+bool ClientConnection::isStreamingReceive() {
+  return server.isStreamingReceive();
+}
+
+bool ClientConnection::isReceivePaused() {
+  return server.getQueueOverflowPolicy() == WebSocketServer::STOP_READING && message_queue.full();
+}
+
+bool ClientConnection::isReceiveDeferred(size_t size) {
+  return server.isReceiveDeferred(size);
+}
+
+bool ClientConnection::reserveReceive(size_t size, bool continuation) {
+  if (!server.reserveReceive(size, continuation)) {
+    return false;
+  }
+  receive_reserved += size;
+  return true;
+}
+
+void ClientConnection::releaseReceive(size_t size) {
+  receive_reserved -= size;
+  server.releaseReceive(size);
+}
+
 void ClientConnection::processWebSocketMessage(WebSocketMessage&& message) {
+  last_message_tick = server.getTimerTick();
+
+  if (message_queue.full()) {
+    // Not reached with STOP_READING, which pauses receive before the queue can overflow
+    if (server.getQueueOverflowPolicy() != WebSocketServer::DROP_OLDEST) {
+      DEBUG("message queue full, dropping newest message");
+      releaseReceive(message.getPayloadSize());
+      return;
+    }
+    DEBUG("message queue full, dropping oldest message");
+    releaseReceive(message_queue.front().getPayloadSize());
+    message_queue.pop();
+  }
+
   message_queue.push(std::move(message));
 }
 
 void ClientConnection::processWebSocketPong(const void* payload, size_t size) {
+#if PICO_WS_SERVER_RTT
+  recordRtt(payload, size);
+#endif
   server.onPong(this, payload, size);
 }
 
+void ClientConnection::processWebSocketFragment(uint8_t opcode, const void* payload, size_t size, bool first, bool last) {
+  last_message_tick = server.getTimerTick();
+  server.onFragment(this, (WebSocketServer::MessageType)opcode, payload, size, first, last);
+}
+
 bool ClientConnection::sendWebSocketTextMessage(const char* payload) {
   if (!http_handler.isUpgraded()) {
     return false;
@@ -90,7 +759,12 @@ bool ClientConnection::sendWebSocketTextMessage(const char* payload) {
     payload = "";
   }
 
-  return ws_handler.sendMessage(WebSocketMessage(WebSocketMessage::TEXT, payload, strlen(payload)));
+  size_t size = strlen(payload);
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+  return ws_handler.sendMessage(WebSocketMessage(WebSocketMessage::TEXT, payload, size));
 }
 
 bool ClientConnection::sendWebSocketBinaryMessage(const void* payload, size_t size) {
@@ -98,16 +772,84 @@ bool ClientConnection::sendWebSocketBinaryMessage(const void* payload, size_t si
     return false;
   }
 
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
   return ws_handler.sendMessage(WebSocketMessage(WebSocketMessage::BINARY, payload, size));
 }
 
+#if PICO_WS_SERVER_PING
 bool ClientConnection::sendWebSocketPing(const void* payload, size_t size) {
   if (!http_handler.isUpgraded()) {
     return false;
   }
 
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+#if PICO_WS_SERVER_RTT
+  if (!size) {
+    return sendStampedPing();
+  }
+#endif
+
   return ws_handler.sendMessage(WebSocketMessage(WebSocketMessage::PING, payload, size));
 }
+#endif
+
+#if PICO_WS_SERVER_RTT
+bool ClientConnection::sendStampedPing() {
+  // Stamped when queued, so time spent waiting behind a partly sent frame counts towards the RTT
+  const uint32_t seq = ping_seq + 1;
+  const uint64_t sent_us = time_us_64();
+  uint8_t stamp[RTT_STAMP_SIZE];
+  memcpy(stamp, &seq, sizeof(seq));
+  memcpy(stamp + sizeof(seq), &sent_us, sizeof(sent_us));
+
+  if (!ws_handler.sendMessage(WebSocketMessage(WebSocketMessage::PING, stamp, sizeof(stamp)))) {
+    return false;
+  }
+  ping_seq = seq;
+  stats.pings_sent++;
+  return true;
+}
+
+void ClientConnection::recordRtt(const void* payload, size_t size) {
+  if (size != RTT_STAMP_SIZE) {
+    return;
+  }
+
+  uint32_t seq;
+  uint64_t sent_us;
+  memcpy(&seq, payload, sizeof(seq));
+  memcpy(&sent_us, (const uint8_t*)payload + sizeof(seq), sizeof(sent_us));
+
+  // Only PINGs sent since the last match count, so repeated (or unrelated) PONGs are ignored
+  const uint64_t now_us = time_us_64();
+  if ((int32_t)(seq - pong_seq) <= 0 || (int32_t)(ping_seq - seq) < 0 || sent_us > now_us) {
+    return;
+  }
+  pong_seq = seq;
+
+  const uint64_t elapsed = now_us - sent_us;
+  const uint32_t rtt_us = elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX;
+  if (!stats.rtt_samples) {
+    stats.rtt_min_us = stats.rtt_max_us = rtt_us;
+    rtt_avg_x8 = (uint64_t)rtt_us * 8;
+  } else {
+    stats.rtt_min_us = rtt_us < stats.rtt_min_us ? rtt_us : stats.rtt_min_us;
+    stats.rtt_max_us = rtt_us > stats.rtt_max_us ? rtt_us : stats.rtt_max_us;
+    rtt_avg_x8 -= rtt_avg_x8 / 8;
+    rtt_avg_x8 += rtt_us;
+  }
+  stats.rtt_samples++;
+  stats.rtt_last_us = rtt_us;
+  stats.rtt_avg_us = (uint32_t)(rtt_avg_x8 / 8);
+  stats.rtt_histogram[rtt_bucket(rtt_us)]++;
+}
+#endif
 
 bool ClientConnection::sendWebSocketMessage(const char* payload) {
   return sendWebSocketTextMessage(payload);
@@ -117,10 +859,134 @@ bool ClientConnection::sendWebSocketMessage(const void* payload, size_t size) {
   return sendWebSocketBinaryMessage(payload, size);
 }
 
-bool ClientConnection::close() {
+bool ClientConnection::sendWebSocketMessageV(WebSocketServer::MessageType type, const WebSocketServer::Segment* parts,
+                                             size_t count) {
+  if (!http_handler.isUpgraded()) {
+    return false;
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += parts[i].len;
+  }
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+  return ws_handler.sendMessageV((WebSocketMessage::Type)type, parts, count, size);
+}
+
+bool ClientConnection::sendSharedFrame(SharedFrame& frame) {
+  if (!http_handler.isUpgraded() || ws_handler.isClosing()) {
+    return false;
+  }
+
+  // Reference large frames where possible, otherwise fall back to copying (or queueing) them. A copy leaves nothing to
+  // track, so the connection can still be closed gracefully before the peer acknowledges it.
+  if (frame.getSize() > PICO_WS_SERVER_SHARED_FRAME_COPY_SIZE && zero_copy_count < PICO_WS_SERVER_MAX_ZERO_COPY_SENDS &&
+      !hasQueuedSends()) {
+    WebSocketServer::Segment part = {frame.data(), frame.getSize()};
+    if (writeFrame(nullptr, 0, &part, 1, /*payload_flags=*/0)) {
+      frame.retain();
+      zero_copy_sends[(zero_copy_head + zero_copy_count) % PICO_WS_SERVER_MAX_ZERO_COPY_SENDS] = {
+          bytes_written, &frame, release_shared_frame};
+      zero_copy_count++;
+      flushSend();
+      return true;
+    }
+    if (ws_handler.isClosing()) {
+      // Abandoned after a partial write
+      return false;
+    }
+  }
+
+  if (!sendRaw(frame.data(), frame.getSize())) {
+    return false;
+  }
+  flushSend();
+  return true;
+}
+
+bool ClientConnection::sendWebSocketMessageZeroCopy(const void* payload, size_t size, WebSocketServer::MessageType type,
+                                                    WebSocketServer::SendCompleteCallback done_cb) {
+  if (!http_handler.isUpgraded()) {
+    return false;
+  }
+
+  if (zero_copy_count == PICO_WS_SERVER_MAX_ZERO_COPY_SENDS) {
+    DEBUG("too many zero-copy sends awaiting acknowledgement");
+    return false;
+  }
+  if (size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+  if (!ws_handler.sendMessageZeroCopy(WebSocketMessage((WebSocketMessage::Type)type, payload, size))) {
+    return false;
+  }
+
+  zero_copy_sends[(zero_copy_head + zero_copy_count) % PICO_WS_SERVER_MAX_ZERO_COPY_SENDS] = {
+      bytes_written, payload, done_cb};
+  zero_copy_count++;
+  return true;
+}
+
+bool ClientConnection::close(uint16_t status_code) {
   if (!http_handler.isUpgraded()) {
     return false;
   }
 
-  return ws_handler.close();
+  return ws_handler.close(status_code);
+}
+
+void ClientConnection::resetLiveness() {
+  liveness_tick = last_message_tick = server.getTimerTick();
+  unanswered_pings = 0;
+  close_checked = false;
+}
+
+ClientConnection::Liveness ClientConnection::checkLiveness(uint32_t* next_check) {
+  const uint32_t now = server.getTimerTick();
+  const uint32_t idle_ticks = server.getIdleTimeoutTicks();
+  const uint32_t keepalive_ticks = server.getKeepaliveTicks();
+  *next_check = 0;
+
+  if (isClosing()) {
+    // The peer has had a whole interval to finish closing (after the CLOSE was sent)
+    if (close_checked && !flushControlFrames()) {
+      return DEAD;
+    }
+    close_checked = true;
+    *next_check = sooner(idle_ticks, keepalive_ticks);
+    return ALIVE;
+  }
+
+  if (idle_ticks) {
+    const uint32_t idle = now - last_message_tick;
+    if (idle >= idle_ticks) {
+      return IDLE;
+    }
+    *next_check = idle_ticks - idle;
+  }
+
+#if PICO_WS_SERVER_PING
+  if (keepalive_ticks) {
+    uint32_t quiet = now - liveness_tick;
+    if (quiet >= keepalive_ticks && http_handler.isUpgraded()) {
+      // Nothing received for an interval, since the last PING if there was one
+      if (unanswered_pings >= server.getKeepaliveMaxMissed()) {
+        return DEAD;
+      }
+      // A PING that can't be sent (e.g. the control queue is full) counts as missed too
+      sendWebSocketPing(nullptr, 0);
+      unanswered_pings++;
+      liveness_tick = now;
+      quiet = 0;
+    }
+    // Before the upgrade, keepalive starts from the next check
+    *next_check = sooner(*next_check, quiet < keepalive_ticks ? keepalive_ticks - quiet : keepalive_ticks);
+  }
+#endif
+
+  return ALIVE;
 }
@@ -2,12 +2,19 @@
 #define __CLIENT_CONNECTION_H__
 
 #include <cstddef>
-#include <queue>
+#include <stdint.h>
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 
+#include "pico_ws_server/config.h"
+#include "pico_ws_server/web_socket_server.h"
 #include "http_handler.h"
+#include "memory_arena.h"
+#include "ring_buffer.h"
+#include "send_queue.h"
+#include "shared_frame.h"
+#include "timer_wheel.h"
 #include "web_socket_handler.h"
 #include "web_socket_message.h"
 
@@ -16,39 +23,255 @@ class WebSocketServerInternal;
 // Only access from lwIP context
 class ClientConnection {
  public:
-  ClientConnection(WebSocketServerInternal& server, struct tcp_pcb* pcb)
-      : server(server), pcb(pcb), http_handler(*this), ws_handler(*this) {}
+  // slot identifies the per-connection resources (arena and message queue) lent by the server
+  ClientConnection(WebSocketServerInternal& server, struct tcp_pcb* pcb, uint32_t slot, MemoryArena& arena,
+                   RingBuffer<WebSocketMessage>& message_queue)
+      : server(server),
+        pcb(pcb),
+        slot(slot),
+        arena(arena),
+        http_handler(*this),
+        ws_handler(*this, arena),
+        message_queue(message_queue),
+        send_queue(arena),
+        held_queue(arena) {
+    for (LatestSlot& latest : latest_slots) {
+      latest.frame = ArenaBuffer(arena);
+    }
+    timer.arg = this;
+  }
+  ~ClientConnection();
 
   // onClose tears down this connection, the reference is no longer safe to use
   void onClose();
   bool isClosing();
+  bool isUpgraded();
+  bool isZeroCopyReceive();
+  uint32_t getSlot() { return slot; }
+  struct tcp_pcb* getPcb() { return pcb; }
+  bool isStreamingReceive();
+  // True while the message queue is full under the STOP_READING policy
+  bool isReceivePaused();
+  bool isReceiveDeferred(size_t size);
+  // Receive budget, see WebSocketServer::setReceiveBudget
+  bool reserveReceive(size_t size, bool continuation);
+  void releaseReceive(size_t size);
 
   void processWebSocketMessage(WebSocketMessage&& message);
   void processWebSocketPong(const void* payload, size_t size);
+  void processWebSocketFragment(uint8_t opcode, const void* payload, size_t size, bool first, bool last);
 
   bool sendWebSocketTextMessage(const char* payload);
   bool sendWebSocketBinaryMessage(const void* payload, size_t size);
+#if PICO_WS_SERVER_PING
+  // PINGs without a payload are stamped for round-trip time measurement, if enabled
   bool sendWebSocketPing(const void* payload, size_t size);
+#endif
+#if PICO_WS_SERVER_RTT
+  const WebSocketServer::ConnectionStats& getStats() { return stats; }
+#endif
 
   bool sendWebSocketMessage(const char* payload);
   bool sendWebSocketMessage(const void* payload, size_t size);
+  bool sendWebSocketMessageV(WebSocketServer::MessageType type, const WebSocketServer::Segment* parts, size_t count);
+  bool sendWebSocketStream(WebSocketServer::MessageType type, size_t total_size, WebSocketServer::StreamProducer producer,
+                           WebSocketServer::StreamCompleteCallback done_cb, void* arg, size_t fragment_size);
+  // Sends a complete encoded frame, holding a reference to it instead of copying where lwIP allows
+  bool sendSharedFrame(SharedFrame& frame);
+  // Fragmented message, sent as each fragment is appended
+  bool beginWebSocketMessage(WebSocketServer::MessageType type);
+  bool appendWebSocketMessage(const void* payload, size_t size);
+  bool endWebSocketMessage();
+  bool sendWebSocketLatest(uint32_t slot_id, const void* payload, size_t size, WebSocketServer::MessageType type);
+  bool sendWebSocketMessageZeroCopy(const void* payload, size_t size, WebSocketServer::MessageType type,
+                                    WebSocketServer::SendCompleteCallback done_cb);
+
+  bool close(uint16_t status_code = 0);
 
-  bool close();
+  // Result of a keepalive and idle timeout check
+  enum Liveness : uint8_t {
+    ALIVE,
+    // No messages received within the idle timeout
+    IDLE,
+    // Keepalive PINGs went unanswered, or a close didn't complete
+    DEAD,
+  };
+  // Starts liveness tracking from now
+  void resetLiveness();
+  // Sends a keepalive PING if due. next_check is the number of ticks until the next check is due (0 if none).
+  Liveness checkLiveness(uint32_t* next_check);
+  TimerWheel::Timer& getTimer() { return timer; }
 
-  void popMessages();
+  // Returns false if the connection should be closed (processing input that was held back failed)
+  bool popMessages();
+  // Takes ownership of pb, and acknowledges it to the peer once processed
   bool process(struct pbuf* pb);
   bool sendRaw(const void* data, size_t size);
+  // Sends a complete PING/PONG/CLOSE frame ahead of any queued data frames (at the next frame boundary), using the
+  // send buffer headroom that data frames leave free
+  bool sendControlFrame(const void* data, size_t size);
+  // Writes a frame header (copied) and payload (referenced until acknowledged), either in full or not at all
+  bool sendRawZeroCopy(const void* header, size_t header_size, const void* payload, size_t size);
+  // As above, but the parts are copied
+  bool sendRawV(const void* header, size_t header_size, const WebSocketServer::Segment* parts, size_t count);
+  // Deferred to flushBatch while sends are batched
   bool flushSend();
-  bool needsSentCallback();
+  bool flushBatch();
+  // Hands as much of the send stream and queue to lwIP as it will take
+  void drainSendQueue();
+  // True if data frames must queue behind earlier sends, to keep their order
+  bool hasQueuedSends() { return control_count || send_stream.producer || !send_queue.empty(); }
+  // As above, or values waiting in conflation slots
+  bool hasPendingSends() { return hasQueuedSends() || latest_pending; }
   bool onSent(uint16_t len);
+  bool hasZeroCopySends() { return zero_copy_count > 0; }
+  // Before a closing connection is given up on, tries once more to send control frames still waiting for room (e.g.
+  // its CLOSE). Returns true if they have now all been sent, so the peer should get another interval to answer.
+  bool flushControlFrames();
 
  private:
   WebSocketServerInternal& server;
   struct tcp_pcb* pcb;
+  uint32_t slot;
+  MemoryArena& arena;
   HTTPHandler http_handler;
   WebSocketHandler ws_handler;
 
-  std::queue<WebSocketMessage> message_queue;
+  RingBuffer<WebSocketMessage>& message_queue;
+
+  // Receive budget held by this connection's queued and partially received messages
+  size_t receive_reserved = 0;
+
+  // Control frames are at most 125 bytes of payload, with an unmasked header of 2 bytes
+  static constexpr size_t MAX_CONTROL_FRAME_SIZE = 127;
+  static constexpr size_t CONTROL_HEADROOM = PICO_WS_SERVER_CONTROL_HEADROOM;
+  // pbufs reserved for control frames, out of TCP_SND_QUEUELEN
+  static constexpr size_t CONTROL_PBUFS = 2;
+
+  // Control frames waiting for a frame boundary or send buffer room, oldest first
+  struct ControlFrame {
+    uint8_t size;
+    uint8_t data[MAX_CONTROL_FRAME_SIZE];
+  };
+  ControlFrame control_frames[PICO_WS_SERVER_CONTROL_QUEUE_SIZE];
+  size_t control_head = 0;
+  size_t control_count = 0;
+
+  // Newest unsent value per conflation slot, as an encoded frame. Buffers are released once sent, so they don't
+  // pin the arena.
+  struct LatestSlot {
+    ArenaBuffer frame;
+    bool pending = false;
+  };
+  static_assert(PICO_WS_SERVER_LATEST_SLOTS > 0, "at least one conflation slot is required");
+  LatestSlot latest_slots[PICO_WS_SERVER_LATEST_SLOTS];
+  size_t latest_pending = 0;
+  // Round-robin position, the slot to try first
+  size_t latest_next = 0;
+
+  // Set when flushSend was deferred by a batch
+  bool flush_pending = false;
+
+  // Message being sent with sendWebSocketStream, active while producer is set
+  struct SendStream {
+    WebSocketServer::StreamProducer producer;
+    WebSocketServer::StreamCompleteCallback done_cb;
+    void* arg;
+    uint8_t type;
+    bool started;
+    size_t total_size;
+    size_t fragment_size;
+    // Payload bytes handed to lwIP
+    size_t offset;
+    // Payload bytes left in the frame whose header was written last
+    size_t frame_remaining;
+  };
+  SendStream send_stream = {};
+
+  // Frames waiting for room in the lwIP send buffer, see WebSocketServer::setSendQueue
+  SendQueue send_queue;
+  // Set between the high and low watermark callbacks
+  bool send_queue_congested = false;
+
+  // Message being sent with beginWebSocketMessage, its fragments are written (or queued) as they are appended
+  struct OutboundMessage {
+    bool open;
+    bool started;
+    uint8_t type;
+  };
+  OutboundMessage outbound_message = {};
+  // Other data frames sent while outbound_message is open, which follow it once it ends
+  SendQueue held_queue;
+
+  // Stream positions, for matching acknowledgements to zero-copy sends (may wrap)
+  uint32_t bytes_written = 0;
+  uint32_t bytes_acked = 0;
+
+  // Zero-copy sends awaiting acknowledgement, oldest first
+  struct ZeroCopySend {
+    // bytes_written once the payload had been written
+    uint32_t end;
+    const void* payload;
+    WebSocketServer::SendCompleteCallback done_cb;
+  };
+  ZeroCopySend zero_copy_sends[PICO_WS_SERVER_MAX_ZERO_COPY_SENDS];
+  size_t zero_copy_head = 0;
+  size_t zero_copy_count = 0;
+
+  // Keepalive and idle timeout state, in timer ticks
+  TimerWheel::Timer timer;
+  // Last input received, or keepalive PING sent
+  uint32_t liveness_tick = 0;
+  uint32_t last_message_tick = 0;
+  uint32_t unanswered_pings = 0;
+  // Set once a check has found the connection closing
+  bool close_checked = false;
+
+#if PICO_WS_SERVER_RTT
+  // A stamp is the PING's sequence number followed by the time it was sent, in microseconds
+  static constexpr size_t RTT_STAMP_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+  WebSocketServer::ConnectionStats stats = {};
+  // Smoothed RTT, scaled by 8
+  uint64_t rtt_avg_x8 = 0;
+  // Sequence numbers of the last stamped PING sent, and the last one matched by a PONG
+  uint32_t ping_seq = 0;
+  uint32_t pong_seq = 0;
+
+  bool sendStampedPing();
+  void recordRtt(const void* payload, size_t size);
+#endif
+
+  // Input held back (and not yet acknowledged) while receive is paused
+  struct pbuf* pending_input = nullptr;
+  size_t pending_offset = 0;
+
+  bool processInput(struct pbuf* pb, size_t offset);
+  // For data frames, which leave CONTROL_HEADROOM free
+  bool canWrite(size_t size, size_t pbufs);
+  size_t getDataSendBuffer();
+  // Largest copied data write, up to size, that canWrite would accept
+  size_t getDataWriteSize(size_t size);
+  // False while a data frame has been partly handed to lwIP
+  bool isAtFrameBoundary();
+  // Writes queued control frames while at a frame boundary, returns true if anything was written
+  bool drainControlFrames();
+  bool writeControlFrame(const uint8_t* data, size_t size);
+  // Writes pending conflation slots round-robin while at a frame boundary, returns true if anything was written
+  bool drainLatest();
+  bool writeLatest(LatestSlot& latest);
+  void clearLatest();
+  // Writes as much of the send stream as lwIP will take, returns true if anything was written
+  bool pumpSendStream();
+  // Copies a frame to the back of queue (send_queue or held_queue). Returns false if it doesn't fit.
+  bool queueFrame(SendQueue& queue, const void* header, size_t header_size, const WebSocketServer::Segment* parts,
+                  size_t count);
+  // Writes header and parts as one frame, payload_flags are applied to the parts. Frames other than fragments of
+  // outbound_message are held back while it is open.
+  bool writeFrame(const void* header, size_t header_size, const WebSocketServer::Segment* parts, size_t count,
+                  uint8_t payload_flags, bool fragment = false);
+  bool writeFragment(bool final, const void* payload, size_t size);
+  // Calls done_cb for the oldest zero-copy send
+  void completeZeroCopySend(bool success);
 };
 
 #endif
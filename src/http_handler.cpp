@@ -12,14 +12,16 @@
 #include "client_connection.h"
 #include "debug.h"
 
+#if PICO_WS_SERVER_STATIC_HTML
 // generated at build time -- see CMakeLists.txt
 #include <static_html_hex.h>
+#endif
 
 namespace {
 
-static constexpr auto MAX_REQUEST_SIZE = 4096;
+static constexpr auto MAX_REQUEST_SIZE = PICO_WS_SERVER_MAX_REQUEST_SIZE;
+static constexpr size_t HTML_CHUNK_SIZE = PICO_WS_SERVER_HTML_CHUNK_SIZE;
 
-static constexpr auto HEADER_BUF_SIZE = 64;
 static constexpr const char EXPECTED_METHOD[] = "GET ";
 static constexpr const char EXPECTED_PATH[] = "/ ";
 static constexpr const char EXPECTED_PROTOCOL[] = "HTTP/1.1\r\n";
@@ -47,6 +49,7 @@ static constexpr const char BAD_METHOD_RESPONSE[] =
   "HTTP/1.1 405 Method Not Allowed\r\n"
   "Connection: close\r\n\r\n";
 
+#if PICO_WS_SERVER_STATIC_HTML
 static constexpr const char HTML_RESPONSE_START[] =
   "HTTP/1.1 200 OK\r\n"
   "Connection: close\r\n"
@@ -55,6 +58,7 @@ static constexpr const char HTML_RESPONSE_START[] =
   "Content-Length: ";
 static constexpr const char HTML_RESPONSE_END[] =
   "\r\n\r\n";
+#endif
 
 static constexpr const char UPGRADE_RESPONSE_START[] =
   "HTTP/1.1 101 Switching Protocols\r\n"
@@ -104,6 +108,7 @@ bool HTTPHandler::sendString(const char* s) {
   return send(s, strlen(s));
 }
 
+#if PICO_WS_SERVER_STATIC_HTML
 bool HTTPHandler::sendHTML() {
   if (!sendString(HTML_RESPONSE_START)) {
     return false;
@@ -161,6 +166,7 @@ bool HTTPHandler::sendHTMLChunks() {
 
   return true;
 }
+#endif
 
 bool HTTPHandler::sendUpgradeResponse(uint8_t* key_accept, size_t key_accept_len) {
   if (!sendString(UPGRADE_RESPONSE_START)) {
@@ -186,6 +192,7 @@ bool HTTPHandler::attemptUpgrade(bool* sent_response) {
     has_ws_version_header ? "has_ws_version_header" : "",
     ws_key_header_value);
   if (!has_upgrade_header && !has_connection_header && !has_ws_version_header) {
+#if PICO_WS_SERVER_STATIC_HTML
     // Not a WebSocket request, serve static HTML
     if (!sendHTML()) {
       DEBUG("failed to send HTML response");
@@ -193,6 +200,11 @@ bool HTTPHandler::attemptUpgrade(bool* sent_response) {
     *sent_response = true;
     // Return true if still sending chunks to keep connection alive
     return serving_static_html;
+#else
+    sendString(NOT_FOUND_RESPONSE);
+    *sent_response = true;
+    return false;
+#endif
   }
 
   if (!has_upgrade_header || !has_connection_header || !has_ws_version_header) {
@@ -320,6 +332,7 @@ bool HTTPHandler::onSent(uint16_t len) {
     return !is_closing;
   }
 
+#if PICO_WS_SERVER_STATIC_HTML
   response_bytes_acked += len;
 
   if (serving_static_html) {
@@ -337,4 +350,8 @@ bool HTTPHandler::onSent(uint16_t len) {
   }
 
   return true;
+#else
+  // No responses are committed without static HTML
+  return false;
+#endif
 }
@@ -6,6 +6,8 @@
 
 #include "lwip/pbuf.h"
 
+#include "pico_ws_server/config.h"
+
 class ClientConnection;
 
 // Only access from lwIP context
@@ -20,8 +22,7 @@ class HTTPHandler {
   bool onSent(uint16_t len);
 
  private:
-  static constexpr auto HEADER_BUF_SIZE = 64;
-  static constexpr size_t HTML_CHUNK_SIZE = 512;
+  static constexpr auto HEADER_BUF_SIZE = PICO_WS_SERVER_HTTP_HEADER_BUF_SIZE;
 
   enum RequestPart {
     METHOD,
@@ -36,9 +37,11 @@ class HTTPHandler {
   bool is_closing = false;
   bool response_committed = false;
   bool serving_static_html = false;
+#if PICO_WS_SERVER_STATIC_HTML
   size_t static_html_offset = 0;
   size_t response_bytes_acked = 0;
   size_t response_total_bytes = 0;
+#endif
 
   size_t request_bytes = 0;
   RequestPart current_part = METHOD;
@@ -53,8 +56,10 @@ class HTTPHandler {
 
   bool send(const void* data, size_t size);
   bool sendString(const char* s);
+#if PICO_WS_SERVER_STATIC_HTML
   bool sendHTML();
   bool sendHTMLChunks();
+#endif
   bool sendUpgradeResponse(uint8_t* key_accept, size_t key_accept_len);
   bool attemptUpgrade(bool* sent_html);
 
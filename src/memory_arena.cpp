@@ -0,0 +1,167 @@
+#include "memory_arena.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+MemoryArena::MemoryArena(size_t capacity) : capacity(capacity & ~(ALIGNMENT - 1)) {
+  if (this->capacity) {
+    buffer = (uint8_t*)malloc(this->capacity);
+  }
+}
+
+MemoryArena::~MemoryArena() {
+  free(buffer);
+}
+
+void* MemoryArena::allocate(size_t size) {
+  if (!capacity) {
+    return malloc(size ? size : 1);
+  }
+  if (!buffer || size > UINT32_MAX - sizeof(BlockHeader) - ALIGNMENT) {
+    return nullptr;
+  }
+
+  size_t block_size = blockSize(size);
+  if (!used) {
+    head = tail = 0;
+  }
+
+  if (isWrapped()) {
+    if (head - tail < block_size) {
+      return nullptr;
+    }
+    return place(block_size);
+  }
+
+  if (capacity - tail >= block_size) {
+    return place(block_size);
+  }
+  if (head < block_size) {
+    return nullptr;
+  }
+
+  // Pad out the end of the ring (reclaimed along with the block before it) and wrap around
+  BlockHeader* padding = (BlockHeader*)&buffer[tail];
+  padding->size = capacity - tail;
+  padding->in_use = 0;
+  used += capacity - tail;
+  tail = 0;
+  return place(block_size);
+}
+
+void* MemoryArena::place(size_t block_size) {
+  BlockHeader* block = (BlockHeader*)&buffer[tail];
+  block->size = block_size;
+  block->in_use = 1;
+
+  used += block_size;
+  tail += block_size;
+  if (tail == capacity) {
+    tail = 0;
+  }
+  return block + 1;
+}
+
+void* MemoryArena::reallocate(void* ptr, size_t size) {
+  if (!capacity) {
+    return realloc(ptr, size ? size : 1);
+  }
+  if (!ptr) {
+    return allocate(size);
+  }
+
+  BlockHeader* block = headerOf(ptr);
+  size_t old_block_size = block->size;
+  size_t new_block_size = blockSize(size);
+  if (new_block_size <= old_block_size && new_block_size + sizeof(BlockHeader) > old_block_size) {
+    return ptr;
+  }
+
+  size_t offset = (uint8_t*)block - buffer;
+  bool is_newest = offset + old_block_size == (tail ? tail : capacity);
+  if (is_newest && size <= UINT32_MAX - sizeof(BlockHeader) - ALIGNMENT) {
+    // Everything from the end of the newest block up to the head (or the end of the ring, if the head is
+    // behind it) is free
+    size_t limit = offset >= head ? capacity : head;
+    if (offset + new_block_size <= limit) {
+      block->size = new_block_size;
+      used = used - old_block_size + new_block_size;
+      tail = offset + new_block_size;
+      if (tail == capacity) {
+        tail = 0;
+      }
+      return ptr;
+    }
+  }
+
+  if (new_block_size <= old_block_size) {
+    // Shrinking an older block, keep it as is
+    return ptr;
+  }
+
+  void* moved = allocate(size);
+  if (!moved) {
+    return nullptr;
+  }
+  memcpy(moved, ptr, old_block_size - sizeof(BlockHeader));
+  release(ptr);
+  return moved;
+}
+
+void MemoryArena::release(void* ptr) {
+  if (!capacity) {
+    free(ptr);
+    return;
+  }
+  if (!ptr) {
+    return;
+  }
+
+  BlockHeader* released = headerOf(ptr);
+  released->in_use = 0;
+  const size_t end = (uint8_t*)released - buffer + released->size;
+  const bool is_newest = end == (tail ? tail : capacity);
+
+  // Reclaim released blocks from the head of the ring
+  while (used) {
+    BlockHeader* block = (BlockHeader*)&buffer[head];
+    if (block->in_use) {
+      break;
+    }
+    used -= block->size;
+    head += block->size;
+    if (head == capacity) {
+      head = 0;
+    }
+  }
+  if (!used) {
+    head = tail = 0;
+  } else if (is_newest) {
+    reclaimTail();
+  }
+}
+
+void MemoryArena::reclaimTail() {
+  // Blocks only link forwards, so walk from the head (which is in use) to find the newest block in use. Released
+  // blocks and padding after it are reclaimed.
+  size_t offset = head;
+  size_t scanned = 0;
+  size_t live_end = head;
+  size_t live_used = 0;
+  while (scanned < used) {
+    const BlockHeader* block = (const BlockHeader*)&buffer[offset];
+    scanned += block->size;
+    offset += block->size;
+    if (offset == capacity) {
+      offset = 0;
+    }
+    if (block->in_use) {
+      live_end = offset;
+      live_used = scanned;
+    }
+  }
+  tail = live_end;
+  used = live_used;
+}
@@ -0,0 +1,107 @@
+#ifndef __MEMORY_ARENA_H__
+#define __MEMORY_ARENA_H__
+
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+
+// Fixed-size ring allocator, reserved up front so that allocations from lwIP context never touch the heap.
+// Allocations are carved from the tail of the ring and reclaimed from the head, which suits the mostly
+// first-in-first-out lifetimes of received messages and outgoing frames. Releasing out of order is allowed,
+// but the space is only reclaimed once everything allocated before it (or everything after it, as for a transient
+// buffer) has been released.
+//
+// An arena with 0 capacity falls back to the heap.
+class MemoryArena {
+ public:
+  explicit MemoryArena(size_t capacity);
+  MemoryArena(const MemoryArena&) = delete;
+  MemoryArena& operator=(const MemoryArena&) = delete;
+  ~MemoryArena();
+
+  // Returns nullptr if the arena is exhausted
+  void* allocate(size_t size);
+  // Grows or shrinks an allocation, in place if it is the most recent allocation (and there is room),
+  // otherwise by copying to a new allocation. Returns nullptr (leaving ptr intact) if the arena is exhausted.
+  void* reallocate(void* ptr, size_t size);
+  void release(void* ptr);
+
+  size_t getCapacity() const { return capacity; }
+  bool isValid() const { return capacity == 0 || buffer != nullptr; }
+
+ private:
+  static constexpr size_t ALIGNMENT = 8;
+
+  struct BlockHeader {
+    // Total block size, including this header
+    uint32_t size;
+    uint32_t in_use;
+  };
+  static_assert(sizeof(BlockHeader) == ALIGNMENT, "block header must preserve alignment");
+
+  uint8_t* buffer = nullptr;
+  size_t capacity;
+  size_t head = 0;
+  size_t tail = 0;
+  size_t used = 0;
+
+  static size_t blockSize(size_t size) { return sizeof(BlockHeader) + ((size + ALIGNMENT - 1) & ~(ALIGNMENT - 1)); }
+  BlockHeader* headerOf(void* ptr) { return (BlockHeader*)((uint8_t*)ptr - sizeof(BlockHeader)); }
+  bool isWrapped() const { return used > 0 && tail <= head; }
+  void* place(size_t block_size);
+  // Moves the tail back to the end of the newest block still in use
+  void reclaimTail();
+};
+
+// Owning handle for a resizable allocation from a MemoryArena
+class ArenaBuffer {
+ public:
+  ArenaBuffer() = default;
+  explicit ArenaBuffer(MemoryArena& arena) : arena(&arena) {}
+  ArenaBuffer(const ArenaBuffer&) = delete;
+  ArenaBuffer& operator=(const ArenaBuffer&) = delete;
+
+  ArenaBuffer(ArenaBuffer&& from)
+      : arena(from.arena), buffer(std::exchange(from.buffer, nullptr)), size(std::exchange(from.size, 0)) {}
+
+  ArenaBuffer& operator=(ArenaBuffer&& from) {
+    reset();
+    arena = from.arena;
+    buffer = std::exchange(from.buffer, nullptr);
+    size = std::exchange(from.size, 0);
+    return *this;
+  }
+
+  ~ArenaBuffer() {
+    reset();
+  }
+
+  // Contents are preserved up to the smaller of the old and new sizes
+  bool resize(size_t new_size) {
+    void* resized = arena->reallocate(buffer, new_size);
+    if (!resized) {
+      return false;
+    }
+    buffer = (uint8_t*)resized;
+    size = new_size;
+    return true;
+  }
+
+  void reset() {
+    if (buffer) {
+      arena->release(buffer);
+      buffer = nullptr;
+    }
+    size = 0;
+  }
+
+  uint8_t* data() const { return buffer; }
+  size_t getSize() const { return size; }
+
+ private:
+  MemoryArena* arena = nullptr;
+  uint8_t* buffer = nullptr;
+  size_t size = 0;
+};
+
+#endif
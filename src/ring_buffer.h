@@ -0,0 +1,69 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Fixed-capacity FIFO queue. Slot storage is allocated once, up front, and items are constructed in place, so
+// pushing and popping never allocate. The producer and consumer must be serialized by the caller (here, both
+// run with the cyw43 lock held).
+template <typename T>
+class RingBuffer {
+ public:
+  explicit RingBuffer(size_t capacity) : slots(std::allocator<T>().allocate(capacity)), capacity(capacity) {}
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  ~RingBuffer() {
+    clear();
+    std::allocator<T>().deallocate(slots, capacity);
+  }
+
+  bool empty() const { return count == 0; }
+  bool full() const { return count == capacity; }
+  size_t size() const { return count; }
+  size_t getCapacity() const { return capacity; }
+
+  // Returns false if the queue is full
+  bool push(T&& item) {
+    if (full()) {
+      return false;
+    }
+
+    size_t tail = head + count;
+    if (tail >= capacity) {
+      tail -= capacity;
+    }
+    new (&slots[tail]) T(std::move(item));
+    count++;
+    return true;
+  }
+
+  // Queue must not be empty
+  T& front() { return slots[head]; }
+
+  // Queue must not be empty
+  void pop() {
+    slots[head].~T();
+    if (++head == capacity) {
+      head = 0;
+    }
+    count--;
+  }
+
+  void clear() {
+    while (!empty()) {
+      pop();
+    }
+  }
+
+ private:
+  T* slots;
+  size_t capacity;
+  size_t head = 0;
+  size_t count = 0;
+};
+
+#endif
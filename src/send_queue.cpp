@@ -0,0 +1,83 @@
+#include "send_queue.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <string.h>
+
+#include "pico_ws_server/web_socket_server.h"
+#include "memory_arena.h"
+
+bool SendQueue::push(const void* header, size_t header_size, const WebSocketServer::Segment* parts, size_t count) {
+  size_t size = header_size;
+  for (size_t i = 0; i < count; i++) {
+    size += parts[i].len;
+  }
+
+  Frame* frame = (Frame*)arena.allocate(sizeof(Frame) + size);
+  if (!frame) {
+    return false;
+  }
+  frame->next = nullptr;
+  frame->size = size;
+  frame->offset = 0;
+
+  uint8_t* data = frame->data();
+  memcpy(data, header, header_size);
+  data += header_size;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(data, parts[i].data, parts[i].len);
+    data += parts[i].len;
+  }
+
+  if (tail) {
+    tail->next = frame;
+  } else {
+    head = frame;
+  }
+  tail = frame;
+  queued += size;
+  return true;
+}
+
+void SendQueue::consume(size_t size) {
+  head->offset += size;
+  queued -= size;
+  if (head->offset < head->size) {
+    return;
+  }
+
+  Frame* next = head->next;
+  arena.release(head);
+  head = next;
+  if (!head) {
+    tail = nullptr;
+  }
+}
+
+void SendQueue::splice(SendQueue& from) {
+  if (from.empty()) {
+    return;
+  }
+
+  if (tail) {
+    tail->next = from.head;
+  } else {
+    head = from.head;
+  }
+  tail = from.tail;
+  queued += from.queued;
+
+  from.head = nullptr;
+  from.tail = nullptr;
+  from.queued = 0;
+}
+
+void SendQueue::clear() {
+  while (head) {
+    Frame* next = head->next;
+    arena.release(head);
+    head = next;
+  }
+  tail = nullptr;
+  queued = 0;
+}
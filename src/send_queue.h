@@ -0,0 +1,54 @@
+#ifndef __SEND_QUEUE_H__
+#define __SEND_QUEUE_H__
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "pico_ws_server/web_socket_server.h"
+#include "memory_arena.h"
+
+// FIFO of outgoing frames that lwIP could not accept yet. Each frame is copied into its own allocation from the
+// connection arena, and frames are released in order as they are handed to lwIP, which suits the arena's ring.
+class SendQueue {
+ public:
+  explicit SendQueue(MemoryArena& arena) : arena(arena) {}
+  SendQueue(const SendQueue&) = delete;
+  SendQueue& operator=(const SendQueue&) = delete;
+  ~SendQueue() { clear(); }
+
+  bool empty() const { return head == nullptr; }
+  // Bytes queued and not yet handed to lwIP
+  size_t size() const { return queued; }
+
+  // Copies header followed by parts into a new frame at the back. Returns false if out of memory.
+  bool push(const void* header, size_t header_size, const WebSocketServer::Segment* parts, size_t count);
+
+  // Unsent remainder of the front frame, queue must not be empty
+  const uint8_t* frontData() const { return head->data() + head->offset; }
+  size_t frontSize() const { return head->size - head->offset; }
+  // True if part of the front frame has been sent
+  bool isFrontStarted() const { return head && head->offset; }
+  // Marks size bytes of the front frame as sent, popping it once complete
+  void consume(size_t size);
+
+  // Moves every frame of from (which must share this queue's arena) to the back of this queue
+  void splice(SendQueue& from);
+
+  void clear();
+
+ private:
+  struct Frame {
+    Frame* next;
+    uint32_t size;
+    uint32_t offset;
+
+    uint8_t* data() { return (uint8_t*)(this + 1); }
+  };
+
+  MemoryArena& arena;
+  Frame* head = nullptr;
+  Frame* tail = nullptr;
+  size_t queued = 0;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "shared_frame.h"
+
+#include <cstddef>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+
+#include "web_socket_frame_builder.h"
+
+SharedFrame* SharedFrame::create(uint8_t opcode, const void* payload, size_t payload_size) {
+  uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+  const size_t header_len = WebSocketFrameBuilder::makeHeader(/*final=*/true, opcode, payload_size, header);
+
+  void* memory = ::operator new(sizeof(SharedFrame) + header_len + payload_size, std::nothrow);
+  if (!memory) {
+    return nullptr;
+  }
+
+  SharedFrame* frame = new (memory) SharedFrame(header_len + payload_size, nullptr);
+  memcpy(frame->mutableData(), header, header_len);
+  if (payload_size) {
+    memcpy(frame->mutableData() + header_len, payload, payload_size);
+  }
+  return frame;
+}
+
+SharedFrame* SharedFrame::createExternal(const void* frame_data, size_t frame_size) {
+  void* memory = ::operator new(sizeof(SharedFrame), std::nothrow);
+  if (!memory) {
+    return nullptr;
+  }
+  return new (memory) SharedFrame(frame_size, (const uint8_t*)frame_data);
+}
+
+void SharedFrame::release() {
+  if (--refs) {
+    return;
+  }
+
+  this->~SharedFrame();
+  ::operator delete(this);
+}
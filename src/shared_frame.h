@@ -0,0 +1,34 @@
+#ifndef __SHARED_FRAME_H__
+#define __SHARED_FRAME_H__
+
+#include <cstddef>
+#include <stdint.h>
+
+// Complete encoded frame (header and payload) shared by several connections or sends, e.g. for a broadcast or a
+// prepared message, so it is built once. Each connection sending it without a copy holds a reference until lwIP is
+// done with it.
+class SharedFrame {
+ public:
+  // Encodes a copy of payload. Returns nullptr if out of memory. The caller holds the first reference.
+  static SharedFrame* create(uint8_t opcode, const void* payload, size_t payload_size);
+  // References an already encoded frame (e.g. constant data in flash), which must outlive the SharedFrame
+  static SharedFrame* createExternal(const void* frame_data, size_t frame_size);
+
+  const uint8_t* data() const { return external_data ? external_data : (const uint8_t*)(this + 1); }
+  size_t getSize() const { return size; }
+
+  void retain() { refs++; }
+  void release();
+
+ private:
+  SharedFrame(size_t size, const uint8_t* external_data) : size(size), external_data(external_data) {}
+
+  uint32_t refs = 1;
+  uint32_t size;
+  // Otherwise, the frame follows this object
+  const uint8_t* external_data;
+
+  uint8_t* mutableData() { return (uint8_t*)(this + 1); }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+
+// Hashed timer wheel. Timers are intrusive nodes, linked into the slot their expiry tick hashes to, so scheduling
+// and cancelling are O(1) and each tick only visits one slot. With at least as many slots as timers, the cost of a
+// tick doesn't grow with the number of timers. Times are in ticks, and may wrap.
+class TimerWheel {
+ public:
+  struct Timer {
+    Timer* prev = nullptr;
+    Timer* next = nullptr;
+    uint32_t expiry = 0;
+    bool scheduled = false;
+    // Identifies the timer's owner on expiry
+    void* arg = nullptr;
+  };
+
+  explicit TimerWheel(size_t slot_count) : slots(std::make_unique<Timer*[]>(slot_count)), slot_count(slot_count) {}
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  uint32_t now() const { return current; }
+
+  // Replaces any earlier schedule. Expires after at least one tick.
+  void schedule(Timer& timer, uint32_t ticks) {
+    cancel(timer);
+    timer.expiry = current + (ticks ? ticks : 1);
+
+    Timer*& head = slots[timer.expiry % slot_count];
+    timer.prev = nullptr;
+    timer.next = head;
+    if (head) {
+      head->prev = &timer;
+    }
+    head = &timer;
+    timer.scheduled = true;
+  }
+
+  void cancel(Timer& timer) {
+    if (!timer.scheduled) {
+      return;
+    }
+
+    if (timer.prev) {
+      timer.prev->next = timer.next;
+    } else {
+      slots[timer.expiry % slot_count] = timer.next;
+    }
+    if (timer.next) {
+      timer.next->prev = timer.prev;
+    }
+    timer.prev = timer.next = nullptr;
+    timer.scheduled = false;
+  }
+
+  // Advances by one tick, calling expired(timer) for each timer that is due. Timers later in the same slot are due
+  // on a later turn of the wheel, and are skipped. expired may schedule or cancel the timer passed to it.
+  template <typename Fn>
+  void tick(Fn&& expired) {
+    current++;
+    Timer* timer = slots[current % slot_count];
+    while (timer) {
+      Timer* next = timer->next;
+      if (timer->expiry == current) {
+        cancel(*timer);
+        expired(*timer);
+      }
+      timer = next;
+    }
+  }
+
+ private:
+  std::unique_ptr<Timer*[]> slots;
+  size_t slot_count;
+  uint32_t current = 0;
+};
+
+#endif
@@ -1,8 +1,11 @@
 #include "web_socket_frame_builder.h"
 
+#include <algorithm>
 #include <limits.h>
-#include <memory>
 #include <stdint.h>
+#include <string.h>
+
+#include "lwip/pbuf.h"
 
 #include "web_socket_message_builder.h"
 
@@ -110,49 +113,70 @@ size_t getPayloadSize(uint8_t* header, size_t max) {
 
 } // namespace
 
-bool WebSocketFrameBuilder::process(uint8_t byte) {
-  bool consumed = false;
-  if (!isHeaderComplete()) {
-    header[header_bytes++] = byte;
-    consumed = true;
-    if (!isHeaderComplete()) {
-      return true;
+bool WebSocketFrameBuilder::process(struct pbuf* segment, size_t* offset) {
+  uint8_t* data = (uint8_t*)segment->payload + *offset;
+  size_t size = segment->len - *offset;
+
+  while (true) {
+    if (!in_payload) {
+      *offset = segment->len - size;
+      if (!size) {
+        return true;
+      }
+      if (!header_bytes && message_builder.isReceivePaused()) {
+        // Stop at the frame boundary, the rest of the segment is processed once receive resumes
+        return true;
+      }
+
+      // Copy as much of the header as is available, at most two steps (the length prefix determines
+      // how many more bytes are needed)
+      size_t header_size;
+      while (header_bytes < (header_size = getHeaderSize()) && size) {
+        size_t chunk = std::min(header_size - header_bytes, size);
+        memcpy(&header[header_bytes], data, chunk);
+        header_bytes += chunk;
+        data += chunk;
+        size -= chunk;
+      }
+      if (header_bytes < header_size) {
+        *offset = segment->len;
+        return true;
+      }
+
+      if (!beginFrame()) {
+        return false;
+      }
+      if (!in_payload) {
+        // Deferred until there is receive budget for the payload. The header is kept, and offered again on the
+        // next call.
+        *offset = segment->len - size;
+        return true;
+      }
     }
-  }
-
-  if (!isMasked(header)) {
-    // Frames from client must be masked
-    return false;
-  }
-  size_t payload_size = getPayloadSize(header, MAX_PAYLOAD_SIZE);
-  if (payload_size == SIZE_MAX) {
-    // Unsupported payload size
-    return false;
-  }
 
-  if (!frame) {
-    frame = std::make_unique<WebSocketFrame>(getOpcode(header), isFinal(header), payload_size);
-  }
+    // Note: 0-length frames (like CLOSE) complete here without consuming any of the next frame's bytes
+    size_t chunk = std::min(payload_size - payload_offset, size);
+    if (chunk) {
+      if (!message_builder.processPayload(segment, data, chunk, payload_offset)) {
+        return false;
+      }
+      payload_offset += chunk;
+      data += chunk;
+      size -= chunk;
+    }
 
-  // Only append byte to payload if:
-  // 1. The byte wasn't consumed by header parsing
-  // 2. The frame actually has a payload (payload_size > 0)
-  // Without the payload_size check, 0-length frames (like CLOSE) would incorrectly
-  // append the first byte of the next frame to their payload
-  if (!consumed && payload_size > 0) {
-    frame->append(byte);
-    consumed = true;
-  }
+    if (payload_offset < payload_size) {
+      *offset = segment->len;
+      return true;
+    }
 
-  if (frame->getPayloadSize() < payload_size) {
-    return true;
+    // Reset and process completed frame
+    header_bytes = 0;
+    in_payload = false;
+    if (!message_builder.endFrame()) {
+      return false;
+    }
   }
-
-  frame->maskPayload(getMask(header));
-
-  // Reset and process completed frame
-  header_bytes = 0;
-  return message_builder.processFrame(std::move(frame));
 }
 
 size_t WebSocketFrameBuilder::makeHeader(bool final, uint8_t opcode, size_t payload_size, uint8_t header_out[MAX_HEADER_SIZE]) {
@@ -174,10 +198,30 @@ size_t WebSocketFrameBuilder::makeHeader(bool final, uint8_t opcode, size_t payl
   return header_len;
 }
 
-bool WebSocketFrameBuilder::isHeaderComplete() {
+bool WebSocketFrameBuilder::beginFrame() {
+  if (!isMasked(header)) {
+    // Frames from client must be masked
+    return false;
+  }
+  // Size limits depend on how the message is consumed, and are enforced by the message builder
+  payload_size = getPayloadSize(header, SIZE_MAX - 1);
+  if (payload_size == SIZE_MAX) {
+    // Unsupported payload size
+    return false;
+  }
+  if (message_builder.isFrameDeferred(getOpcode(header), isFinal(header), payload_size)) {
+    return true;
+  }
+
+  in_payload = true;
+  payload_offset = 0;
+  return message_builder.beginFrame(getOpcode(header), isFinal(header), getMask(header), payload_size);
+}
+
+size_t WebSocketFrameBuilder::getHeaderSize() {
   size_t bytes_needed = MIN_HEADER_LEN;
   if (header_bytes < bytes_needed) {
-    return false;
+    return bytes_needed;
   }
 
   uint8_t pre_len = getPreLen(header);
@@ -192,5 +236,5 @@ bool WebSocketFrameBuilder::isHeaderComplete() {
     bytes_needed += 4;
   }
 
-  return header_bytes >= bytes_needed;
+  return bytes_needed;
 }
@@ -2,10 +2,9 @@
 #define __WEB_SOCKET_FRAME_BUILDER_H__
 
 #include <cstddef>
-#include <memory>
 #include <stdint.h>
 
-#include "web_socket_frame.h"
+#include "lwip/pbuf.h"
 
 class WebSocketMessageBuilder;
 
@@ -16,21 +15,26 @@ class WebSocketFrameBuilder {
   explicit WebSocketFrameBuilder(WebSocketMessageBuilder& message_builder)
       : message_builder(message_builder) {}
 
-  bool process(uint8_t byte);
+  // Consumes one segment of a received pbuf chain, which may contain any number of (partial) frames.
+  // Payload spans are handed to the message builder in place, so it may unmask and/or retain them.
+  // Processing starts at offset, which is updated to where it stopped: the end of the segment, unless receive
+  // was paused at a frame boundary.
+  bool process(struct pbuf* segment, size_t* offset);
 
-  size_t makeHeader(bool final, uint8_t opcode, size_t payload_size, uint8_t header_out[MAX_HEADER_SIZE]);
+  static size_t makeHeader(bool final, uint8_t opcode, size_t payload_size, uint8_t header_out[MAX_HEADER_SIZE]);
 
  private:
-  static constexpr auto MAX_PAYLOAD_SIZE = 64000;
-
   WebSocketMessageBuilder& message_builder;
 
   uint8_t header[MAX_HEADER_SIZE];
   size_t header_bytes = 0;
+  bool in_payload = false;
+  size_t payload_size = 0;
+  size_t payload_offset = 0;
 
-  std::unique_ptr<WebSocketFrame> frame;
-
-  bool isHeaderComplete();
+  bool beginFrame();
+  // Total header size, as far as can be determined from the bytes received so far
+  size_t getHeaderSize();
 };
 
 #endif
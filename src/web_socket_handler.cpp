@@ -1,6 +1,7 @@
 #include "web_socket_handler.h"
 
 #include <cstddef>
+#include <stdint.h>
 
 #include "lwip/pbuf.h"
 
@@ -8,15 +9,31 @@
 #include "debug.h"
 #include "web_socket_message.h"
 
-bool WebSocketHandler::process(struct pbuf* pb) {
-  for (size_t i = 0; i < pb->tot_len; i++) {
-    char c = pbuf_get_at(pb, i);
-    if (!message_builder.process(c)) {
+bool WebSocketHandler::process(struct pbuf* pb, size_t* offset) {
+  // Skip whatever was consumed before receive was paused
+  struct pbuf* q = pb;
+  size_t segment_offset = *offset;
+  while (q && segment_offset >= q->len) {
+    segment_offset -= q->len;
+    q = q->next;
+  }
+
+  // Walk the chain one segment at a time rather than indexing each byte with pbuf_get_at
+  for (; q; q = q->next) {
+    size_t start = segment_offset;
+    bool result = message_builder.process(q, &segment_offset);
+    *offset += segment_offset - start;
+    if (!result) {
       // Attempt a graceful disconnect, but set is_closing regardless
       close();
       is_closing = true;
       return false;
     }
+    if (segment_offset < q->len) {
+      // Paused
+      return true;
+    }
+    segment_offset = 0;
   }
   return true;
 }
@@ -25,10 +42,52 @@ bool WebSocketHandler::sendRaw(const void* data, size_t size) {
   return connection.sendRaw(data, size);
 }
 
+bool WebSocketHandler::sendControlFrame(const void* data, size_t size) {
+  return connection.sendControlFrame(data, size);
+}
+
+bool WebSocketHandler::sendRawZeroCopy(const void* header, size_t header_size, const void* payload, size_t size) {
+  return connection.sendRawZeroCopy(header, header_size, payload, size);
+}
+
+bool WebSocketHandler::sendRawV(const void* header, size_t header_size, const WebSocketServer::Segment* parts,
+                                size_t count) {
+  return connection.sendRawV(header, header_size, parts, count);
+}
+
+size_t WebSocketHandler::makeFrameHeader(bool final, uint8_t opcode, size_t payload_size,
+                                         uint8_t header_out[WebSocketFrameBuilder::MAX_HEADER_SIZE]) {
+  return message_builder.makeFrameHeader(final, opcode, payload_size, header_out);
+}
+
 bool WebSocketHandler::flushSend() {
   return connection.flushSend();
 }
 
+bool WebSocketHandler::isZeroCopyReceive() {
+  return connection.isZeroCopyReceive();
+}
+
+bool WebSocketHandler::isStreamingReceive() {
+  return connection.isStreamingReceive();
+}
+
+bool WebSocketHandler::isReceivePaused() {
+  return connection.isReceivePaused();
+}
+
+bool WebSocketHandler::isReceiveDeferred(size_t size) {
+  return connection.isReceiveDeferred(size);
+}
+
+bool WebSocketHandler::reserveReceive(size_t size, bool continuation) {
+  return connection.reserveReceive(size, continuation);
+}
+
+void WebSocketHandler::processFragment(uint8_t opcode, const void* payload, size_t size, bool first, bool last) {
+  connection.processWebSocketFragment(opcode, payload, size, first, last);
+}
+
 bool WebSocketHandler::processMessage(WebSocketMessage&& message) {
   switch (message.getType()) {
   case WebSocketMessage::TEXT:
@@ -68,12 +127,30 @@ bool WebSocketHandler::sendMessage(const WebSocketMessage& message) {
   return message_builder.sendMessage(message);
 }
 
-bool WebSocketHandler::close() {
+bool WebSocketHandler::sendMessageZeroCopy(const WebSocketMessage& message) {
+  if (is_closing) {
+    return false;
+  }
+
+  return message_builder.sendMessageZeroCopy(message);
+}
+
+bool WebSocketHandler::sendMessageV(WebSocketMessage::Type type, const WebSocketServer::Segment* parts, size_t count,
+                                    size_t size) {
+  if (is_closing) {
+    return false;
+  }
+
+  return message_builder.sendMessageV(type, parts, count, size);
+}
+
+bool WebSocketHandler::close(uint16_t status_code) {
   if (is_closing) {
     return true;
   }
 
-  if (!message_builder.sendMessage(WebSocketMessage(WebSocketMessage::CLOSE, nullptr, 0))) {
+  uint8_t status[2] = {(uint8_t)(status_code >> 8), (uint8_t)(status_code & 0xFF)};
+  if (!message_builder.sendMessage(WebSocketMessage(WebSocketMessage::CLOSE, status, status_code ? 2 : 0))) {
     return false;
   }
 
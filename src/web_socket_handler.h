@@ -2,9 +2,12 @@
 #define __WEB_SOCKET_HANDLER_H__
 
 #include <cstddef>
+#include <stdint.h>
 
 #include "lwip/pbuf.h"
 
+#include "pico_ws_server/web_socket_server.h"
+#include "memory_arena.h"
 #include "web_socket_message.h"
 #include "web_socket_message_builder.h"
 
@@ -13,26 +16,51 @@ class ClientConnection;
 // Only access from lwIP context
 class WebSocketHandler {
  public:
-  explicit WebSocketHandler(ClientConnection& connection)
-      : connection(connection), message_builder(*this) {}
+  // Close status codes (RFC 6455 7.4.1)
+  static constexpr uint16_t CLOSE_MESSAGE_TOO_BIG = 1009;
+  static constexpr uint8_t OPCODE_CONTINUATION = 0x00;
+
+  WebSocketHandler(ClientConnection& connection, MemoryArena& arena)
+      : connection(connection), message_builder(*this, arena) {}
 
   // Methods below must be called from lwIP-safe context
 
-  bool process(struct pbuf* pb);
+  // Processes pb from offset onwards, advancing offset past whatever was consumed. Stops early (returning true)
+  // if receive is paused, in which case the remainder must be passed in again once it resumes.
+  bool process(struct pbuf* pb, size_t* offset);
   bool sendRaw(const void* data, size_t size);
+  bool sendControlFrame(const void* data, size_t size);
+  bool sendRawZeroCopy(const void* header, size_t header_size, const void* payload, size_t size);
+  bool sendRawV(const void* header, size_t header_size, const WebSocketServer::Segment* parts, size_t count);
   bool flushSend();
+  size_t makeFrameHeader(bool final, uint8_t opcode, size_t payload_size,
+                         uint8_t header_out[WebSocketFrameBuilder::MAX_HEADER_SIZE]);
+  bool isZeroCopyReceive();
+  bool isStreamingReceive();
+  bool isReceivePaused();
+  bool isReceiveDeferred(size_t size);
+  bool reserveReceive(size_t size, bool continuation);
 
   bool processMessage(WebSocketMessage&& message);
+  void processFragment(uint8_t opcode, const void* payload, size_t size, bool first, bool last);
 
   bool sendMessage(const WebSocketMessage& message);
-  bool close();
+  bool sendMessageZeroCopy(const WebSocketMessage& message);
+  bool sendMessageV(WebSocketMessage::Type type, const WebSocketServer::Segment* parts, size_t count, size_t size);
+  // status_code of 0 sends a CLOSE frame without a status
+  bool close(uint16_t status_code = 0);
 
   bool isClosing() { return is_closing; }
+  // Gives up on the connection without a CLOSE frame (e.g. the outgoing stream is corrupt), it is aborted on the
+  // next poll
+  void abandon() { is_closing = is_abandoned = true; }
+  bool isAbandoned() { return is_abandoned; }
 
  private:
   ClientConnection& connection;
   WebSocketMessageBuilder message_builder;
   bool is_closing = false;
+  bool is_abandoned = false;
 };
 
 #endif
@@ -0,0 +1,61 @@
+#include "web_socket_mask.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <string.h>
+
+namespace {
+
+// Widest word that can be XORed natively; must be a multiple of the 4-byte key length
+#if UINTPTR_MAX > 0xFFFFFFFF
+typedef uint64_t mask_word_t;
+#else
+typedef uint32_t mask_word_t;
+#endif
+
+} // namespace
+
+void mask_copy(uint8_t* dest, const uint8_t* src, size_t size, uint32_t mask, size_t offset) {
+  uint8_t key[4];
+  key[0] = (mask >> 24) & 0xFF;
+  key[1] = (mask >> 16) & 0xFF;
+  key[2] = (mask >> 8) & 0xFF;
+  key[3] = mask & 0xFF;
+
+  size_t phase = offset & 3;
+
+  // Unaligned head, byte by byte until dest is word aligned
+  while (size && ((uintptr_t)dest & (sizeof(mask_word_t) - 1))) {
+    *dest++ = *src++ ^ key[phase];
+    phase = (phase + 1) & 3;
+    size--;
+  }
+
+  if (size >= sizeof(mask_word_t)) {
+    // Key rotated to the current phase, laid out in memory order so the XOR is endian-agnostic
+    uint8_t rotated[sizeof(mask_word_t)];
+    for (size_t i = 0; i < sizeof(rotated); i++) {
+      rotated[i] = key[(phase + i) & 3];
+    }
+    mask_word_t word_mask;
+    memcpy(&word_mask, rotated, sizeof(word_mask));
+
+    // Word-wide middle; src may still be unaligned, so load through memcpy
+    while (size >= sizeof(mask_word_t)) {
+      mask_word_t word;
+      memcpy(&word, src, sizeof(word));
+      word ^= word_mask;
+      memcpy(dest, &word, sizeof(word));
+      src += sizeof(word);
+      dest += sizeof(word);
+      size -= sizeof(word);
+    }
+  }
+
+  // Tail (phase is unchanged by whole words)
+  while (size) {
+    *dest++ = *src++ ^ key[phase];
+    phase = (phase + 1) & 3;
+    size--;
+  }
+}
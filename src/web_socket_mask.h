@@ -0,0 +1,12 @@
+#ifndef __WEB_SOCKET_MASK_H__
+#define __WEB_SOCKET_MASK_H__
+
+#include <cstddef>
+#include <stdint.h>
+
+// Copies size bytes from src to dest while applying a WebSocket masking key (big-endian, as read from the
+// frame header). offset is the position of src[0] within the frame payload, so that a payload can be
+// unmasked in several pieces (e.g. across pbuf boundaries). dest may be equal to src for in-place unmasking.
+void mask_copy(uint8_t* dest, const uint8_t* src, size_t size, uint32_t mask, size_t offset);
+
+#endif
@@ -0,0 +1,119 @@
+#include "web_socket_message.h"
+
+#include <cstddef>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+
+#include "memory_arena.h"
+#include "web_socket_message_view.h"
+
+const uint8_t* WebSocketMessage::getPayload() const {
+  switch (storage) {
+  case INLINE:
+    return inline_payload;
+  case BUFFER:
+    return buffer.data();
+  case EXTERNAL:
+    return external_payload;
+  default:
+    return nullptr;
+  }
+}
+
+uint8_t* WebSocketMessage::getMutablePayload() {
+  switch (storage) {
+  case INLINE:
+    return inline_payload;
+  case BUFFER:
+    return buffer.data();
+  default:
+    return nullptr;
+  }
+}
+
+bool WebSocketMessage::resizePayload(size_t size, MemoryArena& arena) {
+  if (size > MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+
+  switch (storage) {
+  case INLINE: {
+    if (size < INLINE_PAYLOAD_SIZE) {
+      inline_payload[size] = 0;
+      payload_size = size;
+      return true;
+    }
+
+    ArenaBuffer moved(arena);
+    if (!moved.resize(size + 1)) {
+      return false;
+    }
+    memcpy(moved.data(), inline_payload, payload_size);
+    new (&buffer) ArenaBuffer(std::move(moved));
+    storage = BUFFER;
+    break;
+  }
+
+  case BUFFER:
+    if (!buffer.resize(size + 1)) {
+      return false;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  buffer.data()[size] = 0;
+  payload_size = size;
+  return true;
+}
+
+WebSocketMessageViewPtr WebSocketMessage::releaseView() {
+  if (storage != VIEW) {
+    return nullptr;
+  }
+
+  WebSocketMessageViewPtr released(view);
+  storage = INLINE;
+  payload_size = 0;
+  inline_payload[0] = 0;
+  return released;
+}
+
+void WebSocketMessage::takeStorage(WebSocketMessage& from) {
+  switch (storage) {
+  case INLINE:
+    memcpy(inline_payload, from.inline_payload, payload_size + 1);
+    break;
+  case BUFFER:
+    new (&buffer) ArenaBuffer(std::move(from.buffer));
+    from.buffer.~ArenaBuffer();
+    break;
+  case EXTERNAL:
+    external_payload = from.external_payload;
+    break;
+  case VIEW:
+    view = from.view;
+    break;
+  }
+
+  from.storage = INLINE;
+  from.payload_size = 0;
+  from.inline_payload[0] = 0;
+}
+
+void WebSocketMessage::destroyStorage() {
+  switch (storage) {
+  case BUFFER:
+    buffer.~ArenaBuffer();
+    break;
+  case VIEW:
+    WebSocketMessageView::destroy(view);
+    break;
+  default:
+    break;
+  }
+}
@@ -2,13 +2,10 @@
 #define __WEB_SOCKET_MESSAGE_H__
 
 #include <cstddef>
-#include <list>
-#include <memory>
 #include <stdint.h>
-#include <string.h>
-#include <vector>
 
-#include "web_socket_frame.h"
+#include "memory_arena.h"
+#include "web_socket_message_view.h"
 
 class WebSocketMessage {
  public:
@@ -21,66 +18,71 @@ class WebSocketMessage {
     PONG = 0x0A,
   };
 
-  WebSocketMessage(Type type, const void* payload, size_t payload_size)
-      : type(type), const_payload((uint8_t*)payload), payload_size(payload_size) {}
-
-  WebSocketMessage(WebSocketMessage&& from)
-      : type(from.type),
-        payload_size(from.payload_size),
-        payload(std::move(from.payload)),
-        const_payload(from.const_payload) {}
+  // Owned payloads up to this size (including the NULL terminator) are stored in the message itself
+  static constexpr size_t INLINE_PAYLOAD_SIZE = 48;
+  static constexpr size_t MAX_PAYLOAD_SIZE = (1 << 26) - 1;
 
-  WebSocketMessage& operator=(WebSocketMessage&& from) {
-    type = from.type;
-    payload_size = from.payload_size;
-    payload = std::move(from.payload);
-    const_payload = from.const_payload;
-    return *this;
+  // Empty message with an owned payload, see resizePayload
+  explicit WebSocketMessage(Type type = UNKNOWN) : type(type), storage(INLINE), payload_size(0) {
+    inline_payload[0] = 0;
   }
 
-  explicit WebSocketMessage(const std::list<std::unique_ptr<WebSocketFrame>>& frames) {
-    for (const auto& frame : frames) {
-      payload_size += frame->getPayloadSize();
-    }
+  // Payload is not owned, and must outlive the message. payload_size must not exceed MAX_PAYLOAD_SIZE.
+  WebSocketMessage(Type type, const void* payload, size_t payload_size)
+      : type(type), storage(EXTERNAL), payload_size(payload_size), external_payload((const uint8_t*)payload) {}
 
-    payload.resize(payload_size + 1);
+  // Zero-copy message, payload remains in the received pbufs
+  WebSocketMessage(Type type, WebSocketMessageViewPtr view)
+      : type(type), storage(VIEW), payload_size(view->getPayloadSize()), view(view.release()) {}
 
-    size_t payload_filled = 0;
-    for (const auto& frame : frames) {
-      Type frame_type = opcodeToType(frame->getOpcode());
-      if (frame_type != UNKNOWN) {
-        type = frame_type;
-      }
+  WebSocketMessage(const WebSocketMessage&) = delete;
+  WebSocketMessage& operator=(const WebSocketMessage&) = delete;
 
-      memcpy(&payload[payload_filled], frame->getPayload(), frame->getPayloadSize());
-      payload_filled += frame->getPayloadSize();
+  WebSocketMessage(WebSocketMessage&& from) : type(from.type), storage(from.storage), payload_size(from.payload_size) {
+    takeStorage(from);
+  }
+
+  WebSocketMessage& operator=(WebSocketMessage&& from) {
+    if (this != &from) {
+      destroyStorage();
+      type = from.type;
+      storage = from.storage;
+      payload_size = from.payload_size;
+      takeStorage(from);
     }
+    return *this;
+  }
 
-    // Null terminator to allow payloads to be treated as strings
-    payload[payload_size] = 0;
+  ~WebSocketMessage() {
+    destroyStorage();
   }
 
   Type getType() const {
-    return type;
+    return (Type)type;
+  }
+  // CLOSE, PING, or PONG
+  bool isControl() const {
+    return type & 0x08;
   }
 
   size_t getPayloadSize() const {
     return payload_size;
   }
-  const uint8_t* getPayload() const {
-    if (const_payload) {
-      return const_payload;
-    }
-    return payload.data();
-  }
+  // nullptr for views, which are not contiguous
+  const uint8_t* getPayload() const;
 
- private:
-  Type type = UNKNOWN;
-  size_t payload_size = 0;
-  std::vector<uint8_t> payload;
-  const uint8_t* const_payload = nullptr;
+  // Resizes an owned payload, preserving its contents and keeping a NULL terminator after it. The payload moves
+  // from inline storage to a buffer from arena once it no longer fits. Returns false if out of memory, or if the
+  // payload is not owned.
+  bool resizePayload(size_t size, MemoryArena& arena);
+  uint8_t* getMutablePayload();
 
-  Type opcodeToType(uint8_t opcode) {
+  bool hasView() const {
+    return storage == VIEW;
+  }
+  WebSocketMessageViewPtr releaseView();
+
+  static Type opcodeToType(uint8_t opcode) {
     switch (opcode) {
     case TEXT:
       return TEXT;
@@ -96,6 +98,31 @@ class WebSocketMessage {
       return UNKNOWN;
     }
   }
+
+ private:
+  enum Storage : uint8_t {
+    INLINE,
+    BUFFER,
+    EXTERNAL,
+    VIEW,
+  };
+
+  // Packed into a single word
+  uint32_t type : 4;
+  uint32_t storage : 2;
+  uint32_t payload_size : 26;
+
+  // Discriminated by storage
+  union {
+    uint8_t inline_payload[INLINE_PAYLOAD_SIZE];
+    ArenaBuffer buffer;
+    const uint8_t* external_payload;
+    WebSocketMessageView* view;
+  };
+
+  // Leaves from as an empty inline message
+  void takeStorage(WebSocketMessage& from);
+  void destroyStorage();
 };
 
 #endif
@@ -1,41 +1,177 @@
 #include "web_socket_message_builder.h"
 
-#include <memory>
-#include <new>
 #include <cstring>
 #include <stdint.h>
 
+#include "lwip/pbuf.h"
+
 #include "debug.h"
-#include "web_socket_frame.h"
+#include "memory_arena.h"
 #include "web_socket_frame_builder.h"
 #include "web_socket_handler.h"
+#include "web_socket_mask.h"
+#include "web_socket_message_view.h"
+
+namespace {
+
+constexpr uint8_t CONTROL_OPCODE_BIT = 0x08;
 
-bool WebSocketMessageBuilder::process(uint8_t byte) {
-  return frame_builder.process(byte);
+} // namespace
+
+bool WebSocketMessageBuilder::reject([[maybe_unused]] const char* reason) {
+  DEBUG("rejecting message: %s", reason);
+  handler.close(WebSocketHandler::CLOSE_MESSAGE_TOO_BIG);
+  return false;
 }
 
-bool WebSocketMessageBuilder::processFrame(std::unique_ptr<WebSocketFrame> frame) {
-  if (message_frames.size() >= MAX_MESSAGE_FRAMES) {
+bool WebSocketMessageBuilder::process(struct pbuf* segment, size_t* offset) {
+  return frame_builder.process(segment, offset);
+}
+
+bool WebSocketMessageBuilder::isReceivePaused() {
+  return handler.isReceivePaused();
+}
+
+bool WebSocketMessageBuilder::isFrameDeferred(uint8_t opcode, bool final, size_t payload_size) {
+  // Only new messages wait, once started a message is allowed to complete (see reserveReceive)
+  if ((opcode & CONTROL_OPCODE_BIT) || message_started) {
+    return false;
+  }
+  // An empty message needs no budget. Its header may also be the last input received, so nothing would arrive to
+  // offer it again.
+  if (final && !payload_size) {
     return false;
   }
-  if (total_message_size + frame->getPayloadSize() > MAX_MESSAGE_SIZE) {
+
+  // Only messages that are buffered (reassembled or retained) count against the receive budget
+  if (handler.isStreamingReceive() || (opcode != WebSocketMessage::TEXT && opcode != WebSocketMessage::BINARY)) {
     return false;
   }
+  return handler.isReceiveDeferred(payload_size);
+}
 
-  total_message_size += frame->getPayloadSize();
-  message_frames.push_back(std::move(frame));
+bool WebSocketMessageBuilder::beginFrame(uint8_t opcode, bool final, uint32_t mask, size_t payload_size) {
+  frame_final = final;
+  frame_mask = mask;
+  frame_payload_size = payload_size;
+  frame_opcode = opcode;
+
+  if (opcode & CONTROL_OPCODE_BIT) {
+    // Control frames must not be fragmented, and have a limited payload size (RFC 6455 5.5). They may be
+    // interleaved with the fragments of a data message, so they get their own buffer.
+    return final && payload_size <= MAX_CONTROL_PAYLOAD_SIZE;
+  }
 
-  if (message_frames.back()->isFinal()) {
-    // Reset and process completed message
-    WebSocketMessage message(message_frames);
-    message_frames.clear();
-    total_message_size = 0;
-    return handler.processMessage(std::move(message));
+  if (!message_started) {
+    // First frame of a new data message
+    message_started = true;
+    message_opcode = opcode;
+    message_mode = COPY;
+    reassembled_message = WebSocketMessage(WebSocketMessage::opcodeToType(opcode));
+    if (opcode == WebSocketMessage::TEXT || opcode == WebSocketMessage::BINARY) {
+      if (handler.isStreamingReceive()) {
+        message_mode = STREAM;
+        fragment_first = true;
+      } else if (handler.isZeroCopyReceive()) {
+        message_mode = VIEW;
+        message_view.reset(WebSocketMessageView::create(arena));
+        if (!message_view) {
+          return reject("out of memory");
+        }
+      }
+    }
+  }
+
+  if (message_mode == STREAM) {
+    // Payload is handed off as it arrives, so there is no need to limit the size
+    return true;
+  }
+
+  if (payload_size > MAX_PAYLOAD_SIZE) {
+    return reject("frame too large");
+  }
+  if (++message_frames > MAX_MESSAGE_FRAMES) {
+    return reject("too many frames");
+  }
+  if (total_message_size + payload_size > MAX_MESSAGE_SIZE) {
+    return reject("message too large");
+  }
+  if ((message_opcode == WebSocketMessage::TEXT || message_opcode == WebSocketMessage::BINARY) &&
+      !handler.reserveReceive(payload_size, /*continuation=*/message_frames > 1)) {
+    // Reserved from the announced length, before any of the payload is read
+    return reject("receive budget exhausted");
+  }
+  total_message_size += payload_size;
+
+  if (message_mode == COPY) {
+    // Grow once per frame, using the announced length
+    if (!reassembled_message.resizePayload(total_message_size, arena)) {
+      return reject("out of memory");
+    }
+  }
+  return true;
+}
+
+bool WebSocketMessageBuilder::processPayload(struct pbuf* segment, uint8_t* data, size_t size, size_t offset) {
+  if (frame_opcode & CONTROL_OPCODE_BIT) {
+    mask_copy(&control_payload[offset], data, size, frame_mask, offset);
+    return true;
+  }
+
+  if (message_mode == COPY) {
+    size_t frame_start = total_message_size - frame_payload_size;
+    mask_copy(reassembled_message.getMutablePayload() + frame_start + offset, data, size, frame_mask, offset);
+    return true;
+  }
+
+  mask_copy(data, data, size, frame_mask, offset);
+
+  if (message_mode == VIEW) {
+    if (!message_view->append(segment, data, size)) {
+      return reject("out of memory");
+    }
+    return true;
   }
 
+  bool last = frame_final && offset + size == frame_payload_size;
+  handler.processFragment(message_opcode, data, size, fragment_first, last);
+  fragment_first = false;
   return true;
 }
 
+bool WebSocketMessageBuilder::endFrame() {
+  if (frame_opcode & CONTROL_OPCODE_BIT) {
+    return handler.processMessage(
+        WebSocketMessage(WebSocketMessage::opcodeToType(frame_opcode), control_payload, frame_payload_size));
+  }
+
+  if (!frame_final) {
+    return true;
+  }
+
+  // Reset and process completed message
+  message_started = false;
+  message_frames = 0;
+  total_message_size = 0;
+
+  switch (message_mode) {
+  case STREAM:
+    if (!frame_payload_size) {
+      // The last chunk has not been delivered yet, since this frame had no payload
+      handler.processFragment(message_opcode, nullptr, 0, fragment_first, true);
+    }
+    return true;
+
+  case VIEW:
+    return handler.processMessage(
+        WebSocketMessage(WebSocketMessage::opcodeToType(message_opcode), std::move(message_view)));
+
+  default:
+    // Leaves an empty message behind. The payload is NULL terminated, so it can be treated as a string.
+    return handler.processMessage(std::move(reassembled_message));
+  }
+}
+
 bool WebSocketMessageBuilder::sendMessage(const WebSocketMessage& message) {
   const size_t payload_size = message.getPayloadSize();
 
@@ -48,13 +184,13 @@ bool WebSocketMessageBuilder::sendMessage(const WebSocketMessage& message) {
   // Pack header + payload contiguously so tcp_write sees one frame and avoids partial message errors.
   uint8_t stack_buffer[WebSocketFrameBuilder::MAX_HEADER_SIZE + 256];
   uint8_t* frame_data = stack_buffer;
-  std::unique_ptr<uint8_t[]> heap_buffer;
+  ArenaBuffer arena_buffer(arena);
   if (frame_size > sizeof(stack_buffer)) {
-    heap_buffer.reset(new (std::nothrow) uint8_t[frame_size]);
-    if (!heap_buffer) {
+    if (!arena_buffer.resize(frame_size)) {
+      DEBUG("out of memory");
       return false;
     }
-    frame_data = heap_buffer.get();
+    frame_data = arena_buffer.data();
   }
 
   std::memcpy(frame_data, header, header_len);
@@ -62,7 +198,42 @@ bool WebSocketMessageBuilder::sendMessage(const WebSocketMessage& message) {
     std::memcpy(frame_data + header_len, payload, payload_size);
   }
 
-  if (!handler.sendRaw(frame_data, frame_size)) {
+  const bool sent =
+      message.isControl() ? handler.sendControlFrame(frame_data, frame_size) : handler.sendRaw(frame_data, frame_size);
+  if (!sent) {
+    return false;
+  }
+
+  // Flush must succeed for data to be sent
+  if (!handler.flushSend()) {
+    DEBUG("flushSend failed");
+    return false;
+  }
+  return true;
+}
+
+bool WebSocketMessageBuilder::sendMessageZeroCopy(const WebSocketMessage& message) {
+  uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+  const size_t header_len =
+      frame_builder.makeHeader(/*final=*/true, message.getType(), message.getPayloadSize(), header);
+
+  if (!handler.sendRawZeroCopy(header, header_len, message.getPayload(), message.getPayloadSize())) {
+    return false;
+  }
+
+  // The frame is queued either way, and lwIP retries the output from its timers if this fails
+  if (!handler.flushSend()) {
+    DEBUG("flushSend failed");
+  }
+  return true;
+}
+
+bool WebSocketMessageBuilder::sendMessageV(WebSocketMessage::Type type, const WebSocketServer::Segment* parts,
+                                           size_t count, size_t size) {
+  uint8_t header[WebSocketFrameBuilder::MAX_HEADER_SIZE];
+  const size_t header_len = frame_builder.makeHeader(/*final=*/true, type, size, header);
+
+  if (!handler.sendRawV(header, header_len, parts, count)) {
     return false;
   }
 
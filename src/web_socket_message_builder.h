@@ -2,35 +2,84 @@
 #define __WEB_SOCKET_MESSAGE_BUILDER_H__
 
 #include <cstddef>
-#include <list>
-#include <memory>
 #include <stdint.h>
 
-#include "web_socket_frame.h"
+#include "lwip/pbuf.h"
+
+#include "pico_ws_server/config.h"
+#include "pico_ws_server/web_socket_server.h"
+#include "memory_arena.h"
 #include "web_socket_frame_builder.h"
 #include "web_socket_message.h"
+#include "web_socket_message_view.h"
 
 class WebSocketHandler;
 
 class WebSocketMessageBuilder {
  public:
-  WebSocketMessageBuilder(WebSocketHandler& handler)
-      : handler(handler), frame_builder(*this) {}
+  WebSocketMessageBuilder(WebSocketHandler& handler, MemoryArena& arena)
+      : handler(handler), arena(arena), frame_builder(*this) {}
 
-  bool process(uint8_t byte);
+  bool process(struct pbuf* segment, size_t* offset);
+  bool isReceivePaused();
 
-  bool processFrame(std::unique_ptr<WebSocketFrame> frame);
+  // Called by the frame builder as each received frame is parsed. Payload data is still masked, and may be
+  // unmasked in place.
+  // A deferred frame is offered again (header and all) once receive resumes.
+  bool isFrameDeferred(uint8_t opcode, bool final, size_t payload_size);
+  bool beginFrame(uint8_t opcode, bool final, uint32_t mask, size_t payload_size);
+  bool processPayload(struct pbuf* segment, uint8_t* data, size_t size, size_t offset);
+  bool endFrame();
 
   bool sendMessage(const WebSocketMessage& message);
+  // The payload is referenced by lwIP until acknowledged, rather than copied
+  bool sendMessageZeroCopy(const WebSocketMessage& message);
+  size_t makeFrameHeader(bool final, uint8_t opcode, size_t payload_size,
+                         uint8_t header_out[WebSocketFrameBuilder::MAX_HEADER_SIZE]) {
+    return frame_builder.makeHeader(final, opcode, payload_size, header_out);
+  }
+  // Sends the parts (totalling size bytes) as one frame, without concatenating them first
+  bool sendMessageV(WebSocketMessage::Type type, const WebSocketServer::Segment* parts, size_t count, size_t size);
 
  private:
-  static constexpr auto MAX_MESSAGE_FRAMES = 1024;
-  static constexpr auto MAX_MESSAGE_SIZE = 64000;
+  static constexpr size_t MAX_PAYLOAD_SIZE = PICO_WS_SERVER_MAX_PAYLOAD_SIZE;
+  static constexpr size_t MAX_CONTROL_PAYLOAD_SIZE = 125;
+  static constexpr size_t MAX_MESSAGE_FRAMES = PICO_WS_SERVER_MAX_MESSAGE_FRAMES;
+  static constexpr size_t MAX_MESSAGE_SIZE = PICO_WS_SERVER_MAX_MESSAGE_SIZE;
+  static_assert(MAX_MESSAGE_SIZE <= WebSocketMessage::MAX_PAYLOAD_SIZE, "message size limit too large");
+
+  enum ReceiveMode {
+    // Frames are copied and reassembled into a contiguous message
+    COPY,
+    // Frames are retained in the received pbufs (see WebSocketMessageView)
+    VIEW,
+    // Frames are passed to the fragment callback as they arrive, and not retained
+    STREAM,
+  };
 
   WebSocketHandler& handler;
+  MemoryArena& arena;
   WebSocketFrameBuilder frame_builder;
-  std::list<std::unique_ptr<WebSocketFrame>> message_frames;
+
+  // Frame currently being received
+  uint8_t frame_opcode = 0;
+  bool frame_final = false;
+  uint32_t frame_mask = 0;
+  size_t frame_payload_size = 0;
+  uint8_t control_payload[MAX_CONTROL_PAYLOAD_SIZE];
+
+  // Data message currently being received
+  bool message_started = false;
+  ReceiveMode message_mode = COPY;
+  uint8_t message_opcode = 0;
+  size_t message_frames = 0;
   size_t total_message_size = 0;
+  // Reassembled message (COPY mode), small payloads are written directly to its inline storage
+  WebSocketMessage reassembled_message;
+  WebSocketMessageViewPtr message_view;
+  bool fragment_first = false;
+
+  bool reject(const char* reason);
 };
 
 #endif
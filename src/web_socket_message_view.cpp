@@ -0,0 +1,72 @@
+#include "web_socket_message_view.h"
+
+#include <cstddef>
+#include <new>
+#include <stdint.h>
+
+#include "lwip/pbuf.h"
+
+#include "memory_arena.h"
+
+namespace {
+
+// Grows buffer to hold at least count + 1 items of item_size
+bool reserve_next(ArenaBuffer& buffer, size_t count, size_t item_size) {
+  if ((count + 1) * item_size <= buffer.getSize()) {
+    return true;
+  }
+  size_t new_count = count ? count * 2 : 4;
+  return buffer.resize(new_count * item_size);
+}
+
+} // namespace
+
+WebSocketMessageView* WebSocketMessageView::create(MemoryArena& arena) {
+  void* memory = arena.allocate(sizeof(WebSocketMessageView));
+  if (!memory) {
+    return nullptr;
+  }
+  return new (memory) WebSocketMessageView(arena);
+}
+
+void WebSocketMessageView::destroy(WebSocketMessageView* view) {
+  if (!view) {
+    return;
+  }
+  MemoryArena& arena = view->arena;
+  view->~WebSocketMessageView();
+  arena.release(view);
+}
+
+WebSocketMessageView::~WebSocketMessageView() {
+  struct pbuf** pbufs = (struct pbuf**)retained.data();
+  for (size_t i = 0; i < retained_count; i++) {
+    pbuf_free(pbufs[i]);
+  }
+}
+
+bool WebSocketMessageView::append(struct pbuf* segment, const uint8_t* data, size_t size) {
+  if (!size) {
+    return true;
+  }
+
+  if (!reserve_next(segments, segment_count, sizeof(WebSocketServer::Segment))) {
+    return false;
+  }
+
+  // Each segment is referenced individually (not the whole chain), so a pbuf is only retained once
+  // no matter how many frames it contributes to this message
+  struct pbuf** pbufs = (struct pbuf**)retained.data();
+  if (!retained_count || pbufs[retained_count - 1] != segment) {
+    if (!reserve_next(retained, retained_count, sizeof(struct pbuf*))) {
+      return false;
+    }
+    pbufs = (struct pbuf**)retained.data();
+    pbuf_ref(segment);
+    pbufs[retained_count++] = segment;
+  }
+
+  ((WebSocketServer::Segment*)segments.data())[segment_count++] = {data, size};
+  payload_size += size;
+  return true;
+}
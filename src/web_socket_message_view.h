@@ -0,0 +1,56 @@
+#ifndef __WEB_SOCKET_MESSAGE_VIEW_H__
+#define __WEB_SOCKET_MESSAGE_VIEW_H__
+
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+
+#include "lwip/pbuf.h"
+
+#include "pico_ws_server/web_socket_server.h"
+#include "memory_arena.h"
+
+// Scatter-gather view of a received message, pointing directly into (already unmasked) pbufs.
+// The pbufs are retained for the lifetime of the view.
+// Only access from lwIP context
+class WebSocketMessageView {
+ public:
+  struct Deleter {
+    void operator()(WebSocketMessageView* view) const { destroy(view); }
+  };
+
+  // Views (and their segment lists) are allocated from the connection's arena. Returns nullptr if exhausted.
+  static WebSocketMessageView* create(MemoryArena& arena);
+  static void destroy(WebSocketMessageView* view);
+
+  WebSocketMessageView(const WebSocketMessageView&) = delete;
+  WebSocketMessageView& operator=(const WebSocketMessageView&) = delete;
+
+  // data must point into segment's payload. Returns false if the arena is exhausted.
+  bool append(struct pbuf* segment, const uint8_t* data, size_t size);
+
+  const WebSocketServer::Segment* getSegments() const {
+    return (const WebSocketServer::Segment*)segments.data();
+  }
+  size_t getSegmentCount() const {
+    return segment_count;
+  }
+  size_t getPayloadSize() const {
+    return payload_size;
+  }
+
+ private:
+  explicit WebSocketMessageView(MemoryArena& arena) : arena(arena), segments(arena), retained(arena) {}
+  ~WebSocketMessageView();
+
+  MemoryArena& arena;
+  ArenaBuffer segments;
+  size_t segment_count = 0;
+  ArenaBuffer retained;
+  size_t retained_count = 0;
+  size_t payload_size = 0;
+};
+
+typedef std::unique_ptr<WebSocketMessageView, WebSocketMessageView::Deleter> WebSocketMessageViewPtr;
+
+#endif
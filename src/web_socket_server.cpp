@@ -2,11 +2,14 @@
 
 #include <memory>
 #include <stdint.h>
+#include <string.h>
 
+#include "client_connection.h"
+#include "shared_frame.h"
 #include "web_socket_server_internal.h"
 
-WebSocketServer::WebSocketServer(uint32_t max_connections)
-    : internal(std::make_unique<WebSocketServerInternal>(*this, max_connections)) {}
+WebSocketServer::WebSocketServer(uint32_t max_connections, size_t connection_memory)
+    : internal(std::make_unique<WebSocketServerInternal>(*this, max_connections, connection_memory)) {}
 WebSocketServer::~WebSocketServer() {}
 
 void WebSocketServer::setConnectCallback(ConnectCallback cb) {
@@ -18,9 +21,17 @@ void WebSocketServer::setMessageCallback(MessageCallback cb) {
 void WebSocketServer::setCloseCallback(CloseCallback cb) {
   internal->setCloseCallback(cb);
 }
+#if PICO_WS_SERVER_PING
 void WebSocketServer::setPongCallback(PongCallback cb) {
   internal->setPongCallback(cb);
 }
+#endif
+void WebSocketServer::setMessageViewCallback(MessageViewCallback cb) {
+  internal->setMessageViewCallback(cb);
+}
+void WebSocketServer::setFragmentCallback(FragmentCallback cb) {
+  internal->setFragmentCallback(cb);
+}
 void WebSocketServer::setCallbackExtra(void* arg) {
   callback_extra = arg;
 }
@@ -39,23 +50,211 @@ void WebSocketServer::setTcpNoDelay(bool enabled) {
   internal->setTcpNoDelay(enabled);
 }
 
+void WebSocketServer::setAutoBatch(bool enabled) {
+  internal->setAutoBatch(enabled);
+}
+
+void WebSocketServer::beginBatch() {
+  internal->beginBatch();
+}
+
+void WebSocketServer::endBatch() {
+  internal->endBatch();
+}
+
+WebSocketServer::Batch::Batch(WebSocketServer& server) : internal(*server.internal) {
+  internal.lock();
+}
+
+WebSocketServer::Batch::~Batch() {
+  internal.unlock();
+}
+
+bool WebSocketServer::Batch::send(uint32_t conn_id, const char* payload) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->sendWebSocketMessage(payload);
+}
+
+bool WebSocketServer::Batch::send(uint32_t conn_id, const void* payload, size_t payload_size) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->sendWebSocketMessage(payload, payload_size);
+}
+
+bool WebSocketServer::Batch::sendV(uint32_t conn_id, MessageType type, const Segment* parts, size_t count) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->sendWebSocketMessageV(type, parts, count);
+}
+
+bool WebSocketServer::Batch::sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                                        MessageType type) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->sendWebSocketLatest(slot_id, payload, payload_size, type);
+}
+
+bool WebSocketServer::Batch::sendPrepared(uint32_t conn_id, FrameHandle handle) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return handle && connection && connection->sendSharedFrame(*(SharedFrame*)handle);
+}
+
+#if PICO_WS_SERVER_PING
+bool WebSocketServer::Batch::ping(uint32_t conn_id, const void* payload, size_t payload_size) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->sendWebSocketPing(payload, payload_size);
+}
+#endif
+
+#if PICO_WS_SERVER_BROADCAST
+bool WebSocketServer::Batch::broadcast(const char* payload, uint32_t* failed_slots) {
+  return internal.broadcastMessage(nullptr, TEXT, payload, strlen(payload), failed_slots);
+}
+
+bool WebSocketServer::Batch::broadcast(const void* payload, size_t payload_size, uint32_t* failed_slots) {
+  return internal.broadcastMessage(nullptr, BINARY, payload, payload_size, failed_slots);
+}
+
+bool WebSocketServer::Batch::publish(uint32_t topic, const char* payload, uint32_t* failed_slots) {
+  return internal.publishMessage(topic, TEXT, payload, strlen(payload), failed_slots);
+}
+
+bool WebSocketServer::Batch::publish(uint32_t topic, const void* payload, size_t payload_size,
+                                     uint32_t* failed_slots) {
+  return internal.publishMessage(topic, BINARY, payload, payload_size, failed_slots);
+}
+#endif
+
+bool WebSocketServer::Batch::close(uint32_t conn_id) {
+  ClientConnection* connection = internal.getConnectionById(conn_id);
+  return connection && connection->close();
+}
+
+#if PICO_WS_SERVER_PING
+void WebSocketServer::setKeepalive(uint32_t interval_ms, uint32_t max_missed) {
+  internal->setKeepalive(interval_ms, max_missed);
+}
+#endif
+
+void WebSocketServer::setIdleTimeout(uint32_t timeout_ms) {
+  internal->setIdleTimeout(timeout_ms);
+}
+
+void WebSocketServer::setMessageQueue(size_t capacity, QueueOverflowPolicy policy) {
+  internal->setMessageQueue(capacity, policy);
+}
+
+void WebSocketServer::setReceiveBudget(size_t bytes, ReceiveBudgetPolicy policy) {
+  internal->setReceiveBudget(bytes, policy);
+}
+
+void WebSocketServer::setSendQueue(size_t max_bytes, size_t high_watermark, size_t low_watermark) {
+  internal->setSendQueue(max_bytes, high_watermark, low_watermark);
+}
+
+void WebSocketServer::setSendQueueCallbacks(SendQueueCallback high_cb, SendQueueCallback low_cb) {
+  internal->setSendQueueCallbacks(high_cb, low_cb);
+}
+
 bool WebSocketServer::sendMessage(uint32_t conn_id, const char* payload) {
   return internal->sendMessage(conn_id, payload);
 }
 bool WebSocketServer::sendMessage(uint32_t conn_id, const void* payload, size_t payload_size) {
   return internal->sendMessage(conn_id, payload, payload_size);
 }
+bool WebSocketServer::sendMessageV(uint32_t conn_id, MessageType type, const Segment* parts, size_t count) {
+  return internal->sendMessageV(conn_id, type, parts, count);
+}
+
+bool WebSocketServer::sendMessageStream(uint32_t conn_id, MessageType type, size_t total_size, StreamProducer producer,
+                                        StreamCompleteCallback done_cb, void* arg, size_t fragment_size) {
+  return internal->sendMessageStream(conn_id, type, total_size, producer, done_cb, arg, fragment_size);
+}
+
+bool WebSocketServer::beginMessage(uint32_t conn_id, MessageType type) {
+  return internal->beginMessage(conn_id, type);
+}
+
+bool WebSocketServer::appendMessage(uint32_t conn_id, const void* payload, size_t payload_size) {
+  return internal->appendMessage(conn_id, payload, payload_size);
+}
+
+bool WebSocketServer::endMessage(uint32_t conn_id) {
+  return internal->endMessage(conn_id);
+}
+
+bool WebSocketServer::sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                                 MessageType type) {
+  return internal->sendLatest(conn_id, slot_id, payload, payload_size, type);
+}
+
+WebSocketServer::FrameHandle WebSocketServer::prepareMessage(MessageType type, const void* payload,
+                                                             size_t payload_size) {
+  return internal->prepareMessage(type, payload, payload_size);
+}
+
+WebSocketServer::FrameHandle WebSocketServer::prepareEncodedMessage(const void* frame, size_t frame_size) {
+  return internal->prepareEncodedMessage(frame, frame_size);
+}
+
+void WebSocketServer::releasePrepared(FrameHandle handle) {
+  internal->releasePrepared(handle);
+}
+
+bool WebSocketServer::sendPrepared(uint32_t conn_id, FrameHandle handle) {
+  return internal->sendPrepared(conn_id, handle);
+}
+
+bool WebSocketServer::sendMessageZeroCopy(uint32_t conn_id, const void* payload, size_t payload_size,
+                                          SendCompleteCallback done_cb, MessageType type) {
+  return internal->sendMessageZeroCopy(conn_id, payload, payload_size, done_cb, type);
+}
+
+#if PICO_WS_SERVER_PING
 bool WebSocketServer::sendPing(uint32_t conn_id, const void* payload, size_t payload_size) {
   return internal->sendPing(conn_id, payload, payload_size);
 }
+#endif
+
+#if PICO_WS_SERVER_BROADCAST
+bool WebSocketServer::broadcastMessage(const char* payload, uint32_t* failed_slots) {
+  return internal->broadcastMessage(payload, failed_slots);
+}
+bool WebSocketServer::broadcastMessage(const void* payload, size_t payload_size, uint32_t* failed_slots) {
+  return internal->broadcastMessage(payload, payload_size, failed_slots);
+}
+bool WebSocketServer::broadcastPrepared(FrameHandle handle, uint32_t* failed_slots) {
+  return internal->broadcastPrepared(handle, failed_slots);
+}
+
+bool WebSocketServer::subscribe(uint32_t conn_id, uint32_t topic) {
+  return internal->subscribe(conn_id, topic);
+}
+bool WebSocketServer::unsubscribe(uint32_t conn_id, uint32_t topic) {
+  return internal->unsubscribe(conn_id, topic);
+}
+bool WebSocketServer::publish(uint32_t topic, const char* payload, uint32_t* failed_slots) {
+  return internal->publish(topic, payload, failed_slots);
+}
+bool WebSocketServer::publish(uint32_t topic, const void* payload, size_t payload_size, uint32_t* failed_slots) {
+  return internal->publish(topic, payload, payload_size, failed_slots);
+}
+bool WebSocketServer::publishPrepared(uint32_t topic, FrameHandle handle, uint32_t* failed_slots) {
+  return internal->publishPrepared(topic, handle, failed_slots);
+}
+#endif
 
-bool WebSocketServer::broadcastMessage(const char* payload) {
-  return internal->broadcastMessage(payload);
+bool WebSocketServer::getConnectionSlot(uint32_t conn_id, uint32_t* slot) {
+  return internal->getConnectionSlot(conn_id, slot);
 }
-bool WebSocketServer::broadcastMessage(const void* payload, size_t payload_size) {
-  return internal->broadcastMessage(payload, payload_size);
+
+#if PICO_WS_SERVER_RTT
+bool WebSocketServer::getConnectionStats(uint32_t conn_id, ConnectionStats* stats) {
+  return internal->getConnectionStats(conn_id, stats);
 }
+#endif
 
 bool WebSocketServer::close(uint32_t conn_id) {
   return internal->close(conn_id);
+}
+
+void WebSocketServer::releaseMessage(void* release_handle) {
+  internal->releaseMessage(release_handle);
 }
\ No newline at end of file
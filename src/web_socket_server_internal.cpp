@@ -1,17 +1,48 @@
 #include "web_socket_server_internal.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include "cyw43_config.h"
 #include "lwip/tcp.h"
+#include "lwip/timeouts.h"
 
+#include "pico_ws_server/config.h"
+#include "pico_ws_server/cyw43_guard.h"
 #include "client_connection.h"
 #include "debug.h"
-#include "pico_ws_server/cyw43_guard.h"
+#include "shared_frame.h"
 
 namespace {
 
-constexpr auto POLL_TIMER_COARSE = 10; // around 5 seconds
+constexpr auto POLL_TIMER_COARSE = PICO_WS_SERVER_POLL_INTERVAL;
+
+err_t close_connection(struct tcp_pcb* pcb, ClientConnection* connection) {
+  // Unacknowledged zero-copy sends are failed on close, so lwIP must drop its references to them as well
+  bool must_abort = connection->hasZeroCopySends();
+  if (!must_abort && connection->hasPendingSends()) {
+    // Best effort, tcp_close still sends whatever lwIP accepted (e.g. a queued CLOSE reply)
+    connection->drainSendQueue();
+  }
+
+  tcp_arg(pcb, nullptr);
+  connection->onClose();
+
+  if (must_abort || tcp_close(pcb) != ERR_OK) {
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  return ERR_OK;
+}
+
+// For connections that can't be closed gracefully (e.g. the peer is gone), frees the slot right away
+err_t abort_connection(struct tcp_pcb* pcb, ClientConnection* connection) {
+  tcp_arg(pcb, nullptr);
+  connection->onClose();
+
+  tcp_abort(pcb);
+  return ERR_ABRT;
+}
 
 err_t on_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* pb, err_t err) {
   cyw43_arch_lwip_check();
@@ -28,9 +59,8 @@ err_t on_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* pb, err_t err) {
 
   bool keep_connection;
   if (pb) {
+    // The connection acknowledges and frees pb (possibly later, if receive is paused)
     keep_connection = connection->process(pb);
-    tcp_recved(pcb, pb->tot_len);
-    pbuf_free(pb);
   } else {
     keep_connection = false;
     DEBUG("client disconnected");
@@ -38,14 +68,7 @@ err_t on_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* pb, err_t err) {
 
   if (!keep_connection) {
     DEBUG("closing connection");
-
-    tcp_arg(pcb, nullptr);
-    connection->onClose();
-
-    if (tcp_close(pcb) != ERR_OK) {
-      tcp_abort(pcb);
-      return ERR_ABRT;
-    }
+    return close_connection(pcb, connection);
   }
 
   return ERR_OK;
@@ -59,19 +82,9 @@ err_t on_sent(void* arg, struct tcp_pcb* pcb, u16_t len) {
   }
 
   ClientConnection* connection = (ClientConnection*)arg;
-  if (!connection->needsSentCallback()) {
-    return ERR_OK;
-  }
-
   bool keep_connection = connection->onSent(len);
   if (!keep_connection) {
-    tcp_arg(pcb, nullptr);
-    connection->onClose();
-
-    if (tcp_close(pcb) != ERR_OK) {
-      tcp_abort(pcb);
-      return ERR_ABRT;
-    }
+    return close_connection(pcb, connection);
   }
 
   return ERR_OK;
@@ -88,12 +101,16 @@ err_t on_poll(void* arg, struct tcp_pcb* pcb) {
 
   ClientConnection* connection = (ClientConnection*)arg;
   if (connection->isClosing()) {
-    tcp_arg(pcb, nullptr);
-    connection->onClose();
-
+    if (connection->flushControlFrames()) {
+      return ERR_OK;
+    }
     DEBUG("aborting inactive connection after close request");
-    tcp_abort(pcb);
-    return ERR_ABRT;
+    return abort_connection(pcb, connection);
+  }
+
+  // In case the queue stalled without any data in flight (e.g. the pbuf pool was exhausted)
+  if (connection->hasPendingSends()) {
+    connection->drainSendQueue();
   }
 
   return ERR_OK;
@@ -143,6 +160,15 @@ err_t on_connect(void* arg, struct tcp_pcb* new_pcb, err_t err) {
   return ERR_OK;
 }
 
+void on_timer_tick(void* arg) {
+  ((WebSocketServerInternal*)arg)->onTimerTick();
+}
+
+// Rounds up, so a timeout is never shorter than requested
+uint32_t ms_to_ticks(uint32_t ms) {
+  return (ms + PICO_WS_SERVER_TIMER_TICK_MS - 1) / PICO_WS_SERVER_TIMER_TICK_MS;
+}
+
 struct tcp_pcb* init_listen_pcb(uint16_t port, void* arg) {
   Cyw43Guard guard;
 
@@ -172,6 +198,43 @@ struct tcp_pcb* init_listen_pcb(uint16_t port, void* arg) {
 
 } // namespace
 
+uint32_t WebSocketServerInternal::clampMaxConnections(uint32_t requested_connections) {
+  if (requested_connections > SLOT_MASK + 1) {
+    DEBUG("max_connections limited to %u", (unsigned)(SLOT_MASK + 1));
+    return SLOT_MASK + 1;
+  }
+  return requested_connections;
+}
+
+WebSocketServerInternal::WebSocketServerInternal(WebSocketServer& server, uint32_t requested_connections,
+                                                 size_t connection_memory)
+    : server(server),
+      max_connections(clampMaxConnections(requested_connections)),
+      timer_wheel(max_connections ? max_connections : 1) {
+  connections = std::vector<ConnectionSlot>(max_connections);
+  slot_words = (max_connections + 31) / 32;
+#if PICO_WS_SERVER_BROADCAST
+  topic_subscribers.assign(PICO_WS_SERVER_MAX_TOPICS * slot_words, 0);
+#endif
+  arenas.reserve(max_connections);
+  free_slots.reserve(max_connections);
+  for (uint32_t i = 0; i < max_connections; i++) {
+    arenas.push_back(std::make_unique<MemoryArena>(connection_memory));
+    if (!arenas.back()->isValid()) {
+      DEBUG("failed to reserve connection memory");
+    }
+    free_slots.push_back(max_connections - 1 - i);
+  }
+}
+
+WebSocketServerInternal::~WebSocketServerInternal() {
+  Cyw43Guard guard;
+
+  if (timer_running) {
+    sys_untimeout(on_timer_tick, this);
+  }
+}
+
 bool WebSocketServerInternal::startListening(uint16_t port) {
   Cyw43Guard guard;
 
@@ -180,9 +243,18 @@ bool WebSocketServerInternal::startListening(uint16_t port) {
     return false;
   }
 
+  if (message_queues.empty()) {
+    // Reserved here rather than in the constructor, so the capacity can be configured first
+    message_queues.reserve(max_connections);
+    for (uint32_t i = 0; i < max_connections; i++) {
+      message_queues.push_back(std::make_unique<RingBuffer<WebSocketMessage>>(message_queue_capacity));
+    }
+  }
+
   listen_pcb = init_listen_pcb(port, this);
   if (listen_pcb) {
     tcp_accept(listen_pcb, on_connect);
+    startTimers();
   }
 
   return listen_pcb != nullptr;
@@ -191,11 +263,267 @@ bool WebSocketServerInternal::startListening(uint16_t port) {
 void WebSocketServerInternal::popMessages() {
   Cyw43Guard guard;
 
-  for (const auto& [_, conn] : connection_by_id) {
-    conn->popMessages();
+  // Replies sent from the message callbacks go out together, once per connection
+  if (auto_batch) {
+    beginBatch();
+  }
+
+  for (ConnectionSlot& slot : connections) {
+    if (!slot.connection) {
+      continue;
+    }
+    ClientConnection* connection = &*slot.connection;
+    if (!connection->popMessages()) {
+      DEBUG("closing connection");
+      close_connection(connection->getPcb(), connection);
+    }
+  }
+
+  if (auto_batch) {
+    endBatch();
+  }
+}
+
+#if PICO_WS_SERVER_PING
+void WebSocketServerInternal::setKeepalive(uint32_t interval_ms, uint32_t max_missed) {
+  Cyw43Guard guard;
+
+  keepalive_ticks = ms_to_ticks(interval_ms);
+  keepalive_max_missed = max_missed;
+  startTimers();
+}
+#endif
+
+void WebSocketServerInternal::setIdleTimeout(uint32_t timeout_ms) {
+  Cyw43Guard guard;
+
+  idle_timeout_ticks = ms_to_ticks(timeout_ms);
+  startTimers();
+}
+
+void WebSocketServerInternal::startTimers() {
+  if (!keepalive_ticks && !idle_timeout_ticks) {
+    return;
   }
+
+  // Connections that were not being checked (or were checked less often) are checked from the next tick
+  for (ConnectionSlot& slot : connections) {
+    if (slot.connection) {
+      timer_wheel.schedule(slot.connection->getTimer(), 1);
+    }
+  }
+
+  if (listen_pcb && !timer_running) {
+    sys_timeout(PICO_WS_SERVER_TIMER_TICK_MS, on_timer_tick, this);
+    timer_running = true;
+  }
+}
+
+void WebSocketServerInternal::onTimerTick() {
+  cyw43_arch_lwip_check();
+
+  timer_running = false;
+  timer_wheel.tick([this](TimerWheel::Timer& timer) {
+    onConnectionTimer((ClientConnection*)timer.arg);
+  });
+
+  // Stops once keepalive and idle timeouts are both disabled
+  if (keepalive_ticks || idle_timeout_ticks) {
+    sys_timeout(PICO_WS_SERVER_TIMER_TICK_MS, on_timer_tick, this);
+    timer_running = true;
+  }
+}
+
+void WebSocketServerInternal::onConnectionTimer(ClientConnection* connection) {
+  uint32_t next_check;
+  switch (connection->checkLiveness(&next_check)) {
+  case ClientConnection::ALIVE:
+    if (next_check) {
+      timer_wheel.schedule(connection->getTimer(), next_check);
+    }
+    return;
+
+  case ClientConnection::IDLE:
+    DEBUG("closing idle connection");
+    if (connection->isUpgraded()) {
+      // Going Away. Aborted on a later check if the peer doesn't finish closing.
+      if (connection->close(1001)) {
+        timer_wheel.schedule(connection->getTimer(), idle_timeout_ticks);
+        return;
+      }
+      abort_connection(connection->getPcb(), connection);
+      return;
+    }
+    close_connection(connection->getPcb(), connection);
+    return;
+
+  case ClientConnection::DEAD:
+    DEBUG("aborting unresponsive connection");
+    abort_connection(connection->getPcb(), connection);
+    return;
+  }
+}
+
+void WebSocketServerInternal::beginBatch() {
+  Cyw43Guard guard;
+
+  batch_depth++;
 }
 
+void WebSocketServerInternal::endBatch() {
+  Cyw43Guard guard;
+
+  if (!batch_depth || --batch_depth) {
+    return;
+  }
+
+  for (ConnectionSlot& slot : connections) {
+    if (slot.connection && !slot.connection->flushBatch()) {
+      DEBUG("flushBatch failed");
+    }
+  }
+}
+
+void WebSocketServerInternal::lock() {
+  cyw43_thread_enter();
+  batch_depth++;
+}
+
+void WebSocketServerInternal::unlock() {
+  endBatch();
+  cyw43_thread_exit();
+}
+
+bool WebSocketServerInternal::sendMessageV(uint32_t conn_id, WebSocketServer::MessageType type,
+                                           const WebSocketServer::Segment* parts, size_t count) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->sendWebSocketMessageV(type, parts, count);
+}
+
+bool WebSocketServerInternal::sendMessageStream(uint32_t conn_id, WebSocketServer::MessageType type, size_t total_size,
+                                                WebSocketServer::StreamProducer producer,
+                                                WebSocketServer::StreamCompleteCallback done_cb, void* arg,
+                                                size_t fragment_size) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->sendWebSocketStream(type, total_size, producer, done_cb, arg, fragment_size);
+}
+
+bool WebSocketServerInternal::beginMessage(uint32_t conn_id, WebSocketServer::MessageType type) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->beginWebSocketMessage(type);
+}
+
+bool WebSocketServerInternal::appendMessage(uint32_t conn_id, const void* payload, size_t payload_size) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->appendWebSocketMessage(payload, payload_size);
+}
+
+bool WebSocketServerInternal::endMessage(uint32_t conn_id) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->endWebSocketMessage();
+}
+
+bool WebSocketServerInternal::sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                                         WebSocketServer::MessageType type) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->sendWebSocketLatest(slot_id, payload, payload_size, type);
+}
+
+WebSocketServer::FrameHandle WebSocketServerInternal::prepareMessage(WebSocketServer::MessageType type,
+                                                                   const void* payload, size_t payload_size) {
+  if (payload_size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
+    return nullptr;
+  }
+  return SharedFrame::create(type, payload, payload_size);
+}
+
+WebSocketServer::FrameHandle WebSocketServerInternal::prepareEncodedMessage(const void* frame, size_t frame_size) {
+  return SharedFrame::createExternal(frame, frame_size);
+}
+
+void WebSocketServerInternal::releasePrepared(WebSocketServer::FrameHandle handle) {
+  // Connections may be releasing their own references from lwIP context
+  Cyw43Guard guard;
+
+  if (handle) {
+    ((SharedFrame*)handle)->release();
+  }
+}
+
+bool WebSocketServerInternal::sendPrepared(uint32_t conn_id, WebSocketServer::FrameHandle handle) {
+  Cyw43Guard guard;
+
+  // e.g. prepareMessage ran out of memory
+  if (!handle) {
+    return false;
+  }
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->sendSharedFrame(*(SharedFrame*)handle);
+}
+
+bool WebSocketServerInternal::sendMessageZeroCopy(uint32_t conn_id, const void* payload, size_t payload_size,
+                                                  WebSocketServer::SendCompleteCallback done_cb,
+                                                  WebSocketServer::MessageType type) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    DEBUG("connection not found");
+    return false;
+  }
+
+  return connection->sendWebSocketMessageZeroCopy(payload, payload_size, type, done_cb);
+}
+
+#if PICO_WS_SERVER_PING
 bool WebSocketServerInternal::sendPing(uint32_t conn_id, const void* payload, size_t payload_size) {
   Cyw43Guard guard;
 
@@ -210,6 +538,7 @@ bool WebSocketServerInternal::sendPing(uint32_t conn_id, const void* payload, si
 
   return result;
 }
+#endif
 
 bool WebSocketServerInternal::sendMessage(uint32_t conn_id, const char* payload) {
   Cyw43Guard guard;
@@ -239,39 +568,213 @@ bool WebSocketServerInternal::sendMessage(uint32_t conn_id, const void* payload,
   return result;
 }
 
-bool WebSocketServerInternal::broadcastMessage(const char* payload) {
+#if PICO_WS_SERVER_BROADCAST
+bool WebSocketServerInternal::broadcastMessage(const char* payload, uint32_t* failed_slots) {
+  Cyw43Guard guard;
+
+  return broadcastMessage(nullptr, WebSocketServer::TEXT, payload, strlen(payload), failed_slots);
+}
+
+bool WebSocketServerInternal::broadcastMessage(const void* payload, size_t payload_size, uint32_t* failed_slots) {
   Cyw43Guard guard;
 
-  if (connection_by_id.size() == 0) {
-    DEBUG("connection map is empty");
+  return broadcastMessage(nullptr, WebSocketServer::BINARY, payload, payload_size, failed_slots);
+}
+
+bool WebSocketServerInternal::broadcastMessage(const uint32_t* slot_mask, WebSocketServer::MessageType type,
+                                               const void* payload, size_t payload_size, uint32_t* failed_slots) {
+  clearFailedSlots(failed_slots);
+
+  if (!hasConnections()) {
+    DEBUG("no connections");
+    return false;
+  }
+  if (payload_size > WebSocketMessage::MAX_PAYLOAD_SIZE) {
     return false;
   }
 
-  for (const auto& [_, connection] : connection_by_id) {
-    connection->sendWebSocketMessage(payload);
+  // Encoded once, and shared by every connection
+  SharedFrame* frame = SharedFrame::create(type, payload, payload_size);
+  if (!frame) {
+    DEBUG("out of memory");
+    return false;
   }
 
-  return true;
+  bool all_success = broadcastFrame(*frame, slot_mask, failed_slots);
+  frame->release();
+  return all_success;
 }
 
-bool WebSocketServerInternal::broadcastMessage(const void* payload, size_t payload_size) {
+bool WebSocketServerInternal::broadcastPrepared(WebSocketServer::FrameHandle handle, uint32_t* failed_slots) {
   Cyw43Guard guard;
 
-  if (connection_by_id.size() == 0) {
-    DEBUG("connection map is empty");
+  clearFailedSlots(failed_slots);
+
+  if (!handle) {
+    return false;
+  }
+  if (!hasConnections()) {
+    DEBUG("no connections");
     return false;
   }
 
+  return broadcastFrame(*(SharedFrame*)handle, nullptr, failed_slots);
+}
+
+bool WebSocketServerInternal::broadcastFrame(SharedFrame& frame, const uint32_t* slot_mask, uint32_t* failed_slots) {
   bool all_success = true;
-  for (const auto& [_, connection] : connection_by_id) {
-    if (!connection->sendWebSocketMessage(payload, payload_size)) {
-      all_success = false;
+  for (size_t word = 0; word < slot_words; word++) {
+    // Visits only the set bits, so publishing scales with the subscribers rather than the connections
+    uint32_t bits = slot_mask ? slot_mask[word] : ~0u;
+    while (bits) {
+      const uint32_t slot = word * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      if (slot >= connections.size()) {
+        break;
+      }
+
+      ConnectionSlot& entry = connections[slot];
+      // Connections still serving HTTP aren't part of the broadcast
+      if (!entry.connection || !entry.connection->isUpgraded()) {
+        continue;
+      }
+      if (!entry.connection->sendSharedFrame(frame)) {
+        all_success = false;
+        if (failed_slots) {
+          failed_slots[word] |= 1u << (slot % 32);
+        }
+      }
     }
   }
 
   return all_success;
 }
 
+bool WebSocketServerInternal::subscribe(uint32_t conn_id, uint32_t topic) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  uint32_t* subscribers = getSubscribers(topic);
+  if (!connection || !subscribers) {
+    DEBUG("connection or topic not found");
+    return false;
+  }
+
+  subscribers[connection->getSlot() / 32] |= 1u << (connection->getSlot() % 32);
+  return true;
+}
+
+bool WebSocketServerInternal::unsubscribe(uint32_t conn_id, uint32_t topic) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  uint32_t* subscribers = getSubscribers(topic);
+  if (!connection || !subscribers) {
+    DEBUG("connection or topic not found");
+    return false;
+  }
+
+  subscribers[connection->getSlot() / 32] &= ~(1u << (connection->getSlot() % 32));
+  return true;
+}
+
+bool WebSocketServerInternal::publish(uint32_t topic, const char* payload, uint32_t* failed_slots) {
+  Cyw43Guard guard;
+
+  return publishMessage(topic, WebSocketServer::TEXT, payload, strlen(payload), failed_slots);
+}
+
+bool WebSocketServerInternal::publish(uint32_t topic, const void* payload, size_t payload_size,
+                                      uint32_t* failed_slots) {
+  Cyw43Guard guard;
+
+  return publishMessage(topic, WebSocketServer::BINARY, payload, payload_size, failed_slots);
+}
+
+bool WebSocketServerInternal::publishPrepared(uint32_t topic, WebSocketServer::FrameHandle handle,
+                                              uint32_t* failed_slots) {
+  Cyw43Guard guard;
+
+  clearFailedSlots(failed_slots);
+
+  if (!handle) {
+    return false;
+  }
+  const uint32_t* subscribers = getSubscribers(topic);
+  if (!subscribers) {
+    DEBUG("topic not found");
+    return false;
+  }
+
+  return broadcastFrame(*(SharedFrame*)handle, subscribers, failed_slots);
+}
+
+bool WebSocketServerInternal::publishMessage(uint32_t topic, WebSocketServer::MessageType type, const void* payload,
+                                             size_t payload_size, uint32_t* failed_slots) {
+  const uint32_t* subscribers = getSubscribers(topic);
+  if (!subscribers) {
+    DEBUG("topic not found");
+    clearFailedSlots(failed_slots);
+    return false;
+  }
+  if (!hasSubscribers(subscribers)) {
+    // Not worth encoding
+    clearFailedSlots(failed_slots);
+    return true;
+  }
+
+  return broadcastMessage(subscribers, type, payload, payload_size, failed_slots);
+}
+
+uint32_t* WebSocketServerInternal::getSubscribers(uint32_t topic) {
+  if (topic >= PICO_WS_SERVER_MAX_TOPICS) {
+    return nullptr;
+  }
+  return &topic_subscribers[topic * slot_words];
+}
+
+bool WebSocketServerInternal::hasSubscribers(const uint32_t* subscribers) {
+  for (size_t word = 0; word < slot_words; word++) {
+    if (subscribers[word]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WebSocketServerInternal::clearFailedSlots(uint32_t* failed_slots) {
+  if (failed_slots) {
+    memset(failed_slots, 0, slot_words * sizeof(uint32_t));
+  }
+}
+#endif
+
+bool WebSocketServerInternal::getConnectionSlot(uint32_t conn_id, uint32_t* slot) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    return false;
+  }
+
+  *slot = connection->getSlot();
+  return true;
+}
+
+#if PICO_WS_SERVER_RTT
+bool WebSocketServerInternal::getConnectionStats(uint32_t conn_id, WebSocketServer::ConnectionStats* stats) {
+  Cyw43Guard guard;
+
+  ClientConnection* connection = getConnectionById(conn_id);
+  if (!connection) {
+    return false;
+  }
+
+  *stats = connection->getStats();
+  return true;
+}
+#endif
+
 bool WebSocketServerInternal::close(uint32_t conn_id) {
   Cyw43Guard guard;
 
@@ -286,10 +789,41 @@ bool WebSocketServerInternal::close(uint32_t conn_id) {
   return result;
 }
 
+void WebSocketServerInternal::releaseMessage(void* release_handle) {
+  Cyw43Guard guard;
+
+  WebSocketMessageView* view = (WebSocketMessageView*)release_handle;
+  releaseReceive(view->getPayloadSize());
+  // Frees the retained pbufs
+  WebSocketMessageView::destroy(view);
+}
+
+bool WebSocketServerInternal::isReceiveDeferred(size_t size) {
+  // A reservation larger than the whole budget would wait forever, so it is rejected instead
+  return receive_budget && receive_budget_policy == WebSocketServer::DELAY_RECEIVE && size <= receive_budget &&
+         receive_budget_used + size > receive_budget;
+}
+
+bool WebSocketServerInternal::reserveReceive(size_t size, bool continuation) {
+  // When delaying, a message is only held back before its first frame. Holding back a message that is already
+  // partly received could deadlock (connections waiting on each other's budget), so it may overrun instead.
+  bool may_overrun = continuation && receive_budget_policy == WebSocketServer::DELAY_RECEIVE;
+  if (receive_budget && size && !may_overrun && receive_budget_used + size > receive_budget) {
+    return false;
+  }
+  // Tracked even while unlimited, so the budget can be enabled at any time
+  receive_budget_used += size;
+  return true;
+}
+
+void WebSocketServerInternal::releaseReceive(size_t size) {
+  receive_budget_used -= size;
+}
+
 ClientConnection* WebSocketServerInternal::onConnect(struct tcp_pcb* pcb) {
   cyw43_arch_lwip_check();
 
-  if (connection_by_id.size() >= max_connections) {
+  if (free_slots.empty()) {
     return nullptr;
   }
 
@@ -298,13 +832,16 @@ ClientConnection* WebSocketServerInternal::onConnect(struct tcp_pcb* pcb) {
     tcp_nagle_disable(pcb);
   }
 
-  auto connection = std::make_unique<ClientConnection>(*this, pcb);
-  ClientConnection* connection_ptr = connection.get();
-  uint32_t conn_id = getConnectionId(connection_ptr);
-
-  connection_by_id[conn_id] = std::move(connection);
+  uint32_t slot = free_slots.back();
+  free_slots.pop_back();
 
-  return connection_ptr;
+  ClientConnection& connection = connections[slot].connection.emplace(*this, pcb, slot, *arenas[slot],
+                                                                     *message_queues[slot]);
+  connection.resetLiveness();
+  if (keepalive_ticks || idle_timeout_ticks) {
+    timer_wheel.schedule(connection.getTimer(), 1);
+  }
+  return &connection;
 }
 
 void WebSocketServerInternal::onUpgrade(ClientConnection* connection) {
@@ -324,7 +861,20 @@ void WebSocketServerInternal::onClose(ClientConnection* connection, bool is_upgr
     close_cb(server, conn_id);
   }
 
-  connection_by_id.erase(conn_id);
+  // Allocations still held by the application (e.g. message views) remain valid after the arena is reused
+  ConnectionSlot& slot = connections[connection->getSlot()];
+#if PICO_WS_SERVER_BROADCAST
+  // Subscriptions end with the connection
+  const uint32_t bit = 1u << (connection->getSlot() % 32);
+  for (size_t topic = 0; topic < PICO_WS_SERVER_MAX_TOPICS; topic++) {
+    topic_subscribers[topic * slot_words + connection->getSlot() / 32] &= ~bit;
+  }
+#endif
+  free_slots.push_back(connection->getSlot());
+  slot.connection.reset();
+  if (++slot.generation == 0) {
+    slot.generation = 1;
+  }
 }
 
 void WebSocketServerInternal::onMessage(ClientConnection* connection, const void* payload, size_t size) {
@@ -335,26 +885,96 @@ void WebSocketServerInternal::onMessage(ClientConnection* connection, const void
   }
 }
 
+void WebSocketServerInternal::onMessageView(ClientConnection* connection, WebSocketMessageViewPtr view) {
+  cyw43_arch_lwip_check();
+
+  if (!message_view_cb) {
+    releaseReceive(view->getPayloadSize());
+    return;
+  }
+
+  // Ownership passes to the application until releaseMessage
+  WebSocketMessageView* view_ptr = view.release();
+  message_view_cb(server, getConnectionId(connection), view_ptr->getSegments(), view_ptr->getSegmentCount(), view_ptr);
+}
+
 void WebSocketServerInternal::onPong(ClientConnection* connection, const void* payload, size_t size) {
   cyw43_arch_lwip_check();
 
+#if PICO_WS_SERVER_PING
   if (pong_cb) {
     pong_cb(server, getConnectionId(connection), payload, size);
   }
+#endif
+}
+
+void WebSocketServerInternal::onSendComplete(ClientConnection* connection, const void* payload,
+                                             WebSocketServer::SendCompleteCallback done_cb, bool success) {
+  cyw43_arch_lwip_check();
+
+  if (done_cb) {
+    done_cb(server, getConnectionId(connection), payload, success);
+  }
+}
+
+size_t WebSocketServerInternal::pullSendStream(ClientConnection* connection, WebSocketServer::StreamProducer producer,
+                                              size_t offset, size_t max_size, const void** data, void* arg) {
+  cyw43_arch_lwip_check();
+
+  return producer(server, getConnectionId(connection), offset, max_size, data, arg);
+}
+
+void WebSocketServerInternal::onSendStreamComplete(ClientConnection* connection,
+                                                   WebSocketServer::StreamCompleteCallback done_cb, void* arg,
+                                                   bool success) {
+  cyw43_arch_lwip_check();
+
+  if (done_cb) {
+    done_cb(server, getConnectionId(connection), arg, success);
+  }
+}
+
+void WebSocketServerInternal::onSendQueueHigh(ClientConnection* connection, size_t queued_bytes) {
+  cyw43_arch_lwip_check();
+
+  if (send_queue_high_cb) {
+    send_queue_high_cb(server, getConnectionId(connection), queued_bytes);
+  }
+}
+
+void WebSocketServerInternal::onSendQueueLow(ClientConnection* connection, size_t queued_bytes) {
+  cyw43_arch_lwip_check();
+
+  if (send_queue_low_cb) {
+    send_queue_low_cb(server, getConnectionId(connection), queued_bytes);
+  }
+}
+
+void WebSocketServerInternal::onFragment(ClientConnection* connection, WebSocketServer::MessageType type,
+                                         const void* payload, size_t size, bool first, bool last) {
+  cyw43_arch_lwip_check();
+
+  if (fragment_cb) {
+    fragment_cb(server, getConnectionId(connection), type, payload, size, first, last);
+  }
 }
 
 uint32_t WebSocketServerInternal::getConnectionId(ClientConnection* connection) {
-  // Use the connection instance address as a unique ID
-  return (uint32_t)connection;
+  const uint32_t slot = connection->getSlot();
+  return ((uint32_t)connections[slot].generation << SLOT_BITS) | slot;
 }
 
 ClientConnection* WebSocketServerInternal::getConnectionById(uint32_t conn_id) {
-  Cyw43Guard guard;
+  cyw43_arch_lwip_check();
 
-  auto iter = connection_by_id.find(conn_id);
-  if (iter == connection_by_id.end()) {
+  const uint32_t slot = conn_id & SLOT_MASK;
+  if (slot >= connections.size()) {
     return nullptr;
   }
 
-  return iter->second.get();
+  ConnectionSlot& entry = connections[slot];
+  if (!entry.connection || entry.generation != conn_id >> SLOT_BITS) {
+    return nullptr;
+  }
+  return &*entry.connection;
 }
@@ -3,58 +3,240 @@
 
 #include <cstddef>
 #include <memory>
-#include <unordered_map>
+#include <optional>
+#include <vector>
 
 #include "lwip/tcp.h"
 
+#include "pico_ws_server/config.h"
 #include "pico_ws_server/web_socket_server.h"
 #include "client_connection.h"
+#include "memory_arena.h"
+#include "ring_buffer.h"
+#include "shared_frame.h"
+#include "timer_wheel.h"
+#include "web_socket_message.h"
+#include "web_socket_message_view.h"
 
 // Not multicore safe
 class WebSocketServerInternal {
  public:
-  WebSocketServerInternal(WebSocketServer& server, uint32_t max_connections)
-      : server(server), max_connections(max_connections) {}
+  // requested_connections is limited to the number of slots a connection ID can address
+  WebSocketServerInternal(WebSocketServer& server, uint32_t requested_connections, size_t connection_memory);
+  ~WebSocketServerInternal();
 
   void setConnectCallback(WebSocketServer::ConnectCallback cb) { connect_cb = cb; }
   void setCloseCallback(WebSocketServer::CloseCallback cb) { close_cb = cb; }
   void setMessageCallback(WebSocketServer::MessageCallback cb) { message_cb = cb; }
+#if PICO_WS_SERVER_PING
   void setPongCallback(WebSocketServer::PongCallback cb) { pong_cb = cb; }
+#endif
+  void setMessageViewCallback(WebSocketServer::MessageViewCallback cb) { message_view_cb = cb; }
+  void setFragmentCallback(WebSocketServer::FragmentCallback cb) { fragment_cb = cb; }
   void setTcpNoDelay(bool enabled) { tcp_nodelay = enabled; }
+  void setAutoBatch(bool enabled) { auto_batch = enabled; }
+  void setMessageQueue(size_t capacity, WebSocketServer::QueueOverflowPolicy policy) {
+    message_queue_capacity = capacity ? capacity : 1;
+    queue_overflow_policy = policy;
+  }
+  WebSocketServer::QueueOverflowPolicy getQueueOverflowPolicy() { return queue_overflow_policy; }
+  void setReceiveBudget(size_t bytes, WebSocketServer::ReceiveBudgetPolicy policy) {
+    receive_budget = bytes;
+    receive_budget_policy = policy;
+  }
+
+  void setSendQueue(size_t max_bytes, size_t high_watermark, size_t low_watermark) {
+    send_queue_limit = max_bytes;
+    send_queue_high_watermark = high_watermark;
+    send_queue_low_watermark = low_watermark;
+  }
+  void setSendQueueCallbacks(WebSocketServer::SendQueueCallback high_cb, WebSocketServer::SendQueueCallback low_cb) {
+    send_queue_high_cb = high_cb;
+    send_queue_low_cb = low_cb;
+  }
+#if PICO_WS_SERVER_PING
+  void setKeepalive(uint32_t interval_ms, uint32_t max_missed);
+#endif
+  void setIdleTimeout(uint32_t timeout_ms);
+  uint32_t getKeepaliveTicks() { return keepalive_ticks; }
+  uint32_t getKeepaliveMaxMissed() { return keepalive_max_missed; }
+  uint32_t getIdleTimeoutTicks() { return idle_timeout_ticks; }
+  uint32_t getTimerTick() { return timer_wheel.now(); }
+  void cancelTimer(TimerWheel::Timer& timer) { timer_wheel.cancel(timer); }
+  // Advances the timer wheel, from the lwIP timeout
+  void onTimerTick();
+
+  size_t getSendQueueLimit() { return send_queue_limit; }
+  size_t getSendQueueHighWatermark() { return send_queue_high_watermark; }
+  size_t getSendQueueLowWatermark() { return send_queue_low_watermark; }
 
   bool startListening(uint16_t port);
   void popMessages();
 
+  void beginBatch();
+  void endBatch();
+  bool isSendBatched() { return batch_depth > 0; }
+
   bool sendMessage(uint32_t conn_id, const char* payload);
   bool sendMessage(uint32_t conn_id, const void* payload, size_t payload_size);
+  bool sendMessageV(uint32_t conn_id, WebSocketServer::MessageType type, const WebSocketServer::Segment* parts,
+                    size_t count);
+  bool sendMessageStream(uint32_t conn_id, WebSocketServer::MessageType type, size_t total_size,
+                         WebSocketServer::StreamProducer producer, WebSocketServer::StreamCompleteCallback done_cb,
+                         void* arg, size_t fragment_size);
+  bool beginMessage(uint32_t conn_id, WebSocketServer::MessageType type);
+  bool appendMessage(uint32_t conn_id, const void* payload, size_t payload_size);
+  bool endMessage(uint32_t conn_id);
+  bool sendLatest(uint32_t conn_id, uint32_t slot_id, const void* payload, size_t payload_size,
+                  WebSocketServer::MessageType type);
+  WebSocketServer::FrameHandle prepareMessage(WebSocketServer::MessageType type, const void* payload,
+                                              size_t payload_size);
+  WebSocketServer::FrameHandle prepareEncodedMessage(const void* frame, size_t frame_size);
+  void releasePrepared(WebSocketServer::FrameHandle handle);
+  bool sendPrepared(uint32_t conn_id, WebSocketServer::FrameHandle handle);
+  bool sendMessageZeroCopy(uint32_t conn_id, const void* payload, size_t payload_size,
+                           WebSocketServer::SendCompleteCallback done_cb, WebSocketServer::MessageType type);
+#if PICO_WS_SERVER_PING
   bool sendPing(uint32_t conn_id, const void* payload, size_t payload_size);
-  bool broadcastMessage(const char* payload);
-  bool broadcastMessage(const void* payload, size_t payload_size);
+#endif
+#if PICO_WS_SERVER_BROADCAST
+  bool broadcastMessage(const char* payload, uint32_t* failed_slots);
+  bool broadcastMessage(const void* payload, size_t payload_size, uint32_t* failed_slots);
+  bool broadcastPrepared(WebSocketServer::FrameHandle handle, uint32_t* failed_slots);
+  bool subscribe(uint32_t conn_id, uint32_t topic);
+  bool unsubscribe(uint32_t conn_id, uint32_t topic);
+  bool publish(uint32_t topic, const char* payload, uint32_t* failed_slots);
+  bool publish(uint32_t topic, const void* payload, size_t payload_size, uint32_t* failed_slots);
+  bool publishPrepared(uint32_t topic, WebSocketServer::FrameHandle handle, uint32_t* failed_slots);
+#endif
+  bool getConnectionSlot(uint32_t conn_id, uint32_t* slot);
+#if PICO_WS_SERVER_RTT
+  bool getConnectionStats(uint32_t conn_id, WebSocketServer::ConnectionStats* stats);
+#endif
 
   bool close(uint32_t conn_id);
+  void releaseMessage(void* release_handle);
 
   ClientConnection* onConnect(struct tcp_pcb* pcb);
   void onUpgrade(ClientConnection* connection);
   void onClose(ClientConnection* connection, bool is_upgraded);
 
   void onMessage(ClientConnection* connection, const void* payload, size_t size);
+  void onMessageView(ClientConnection* connection, WebSocketMessageViewPtr view);
   void onPong(ClientConnection* connection, const void* payload, size_t size);
+  void onSendComplete(ClientConnection* connection, const void* payload, WebSocketServer::SendCompleteCallback done_cb,
+                      bool success);
+  size_t pullSendStream(ClientConnection* connection, WebSocketServer::StreamProducer producer, size_t offset,
+                        size_t max_size, const void** data, void* arg);
+  void onSendStreamComplete(ClientConnection* connection, WebSocketServer::StreamCompleteCallback done_cb, void* arg,
+                            bool success);
+  void onSendQueueHigh(ClientConnection* connection, size_t queued_bytes);
+  void onSendQueueLow(ClientConnection* connection, size_t queued_bytes);
+  void onFragment(ClientConnection* connection, WebSocketServer::MessageType type, const void* payload, size_t size,
+                  bool first, bool last);
+
+  // True if a reservation of size should wait for budget to be released (DELAY_RECEIVE)
+  bool isReceiveDeferred(size_t size);
+  // Returns false if the budget is exhausted. continuation marks the later frames of a message.
+  bool reserveReceive(size_t size, bool continuation);
+  void releaseReceive(size_t size);
+
+  bool isZeroCopyReceive() { return message_view_cb != nullptr; }
+
+  // Held by WebSocketServer::Batch, which calls into connections directly while it holds the lock
+  friend class WebSocketServer::Batch;
+  bool isStreamingReceive() { return fragment_cb != nullptr; }
 
  private:
   WebSocketServer& server;
 
   uint32_t max_connections;
   bool tcp_nodelay = false;
+  bool auto_batch = false;
+  // Nesting depth of beginBatch/endBatch
+  uint32_t batch_depth = 0;
+  size_t message_queue_capacity = 16;
+  WebSocketServer::QueueOverflowPolicy queue_overflow_policy = WebSocketServer::STOP_READING;
+  // 0 is unlimited
+  size_t receive_budget = 0;
+  size_t receive_budget_used = 0;
+  WebSocketServer::ReceiveBudgetPolicy receive_budget_policy = WebSocketServer::DELAY_RECEIVE;
+  // 0 disables the send queue
+  size_t send_queue_limit = 0;
+  size_t send_queue_high_watermark = 0;
+  size_t send_queue_low_watermark = 0;
   WebSocketServer::ConnectCallback connect_cb = nullptr;
   WebSocketServer::MessageCallback message_cb = nullptr;
   WebSocketServer::CloseCallback close_cb = nullptr;
+#if PICO_WS_SERVER_PING
   WebSocketServer::PongCallback pong_cb = nullptr;
+#endif
+  WebSocketServer::MessageViewCallback message_view_cb = nullptr;
+  WebSocketServer::FragmentCallback fragment_cb = nullptr;
+  WebSocketServer::SendQueueCallback send_queue_high_cb = nullptr;
+  WebSocketServer::SendQueueCallback send_queue_low_cb = nullptr;
+  // In timer ticks, 0 disables
+  uint32_t keepalive_ticks = 0;
+  uint32_t keepalive_max_missed = 0;
+  uint32_t idle_timeout_ticks = 0;
+  // Set while the lwIP timeout is pending
+  bool timer_running = false;
 
   struct tcp_pcb* listen_pcb = nullptr;
-  std::unordered_map<uint32_t, std::unique_ptr<ClientConnection>> connection_by_id;
+  // One arena and message queue per connection slot, reserved up front (declared first, so connections are
+  // destroyed before them)
+  std::vector<std::unique_ptr<MemoryArena>> arenas;
+  std::vector<std::unique_ptr<RingBuffer<WebSocketMessage>>> message_queues;
+  std::vector<uint32_t> free_slots;
+
+  // One timer per connection, for keepalive and idle timeouts (declared before connections, which cancel theirs)
+  TimerWheel timer_wheel;
+
+  // Connection IDs are the slot in the low bits and the slot's generation in the high bits. The generation
+  // advances each time the slot is freed (and is never 0, nor is an ID), so a stale ID doesn't find a newer client.
+  static constexpr uint32_t SLOT_BITS = 16;
+  static constexpr uint32_t SLOT_MASK = (1u << SLOT_BITS) - 1;
+  struct ConnectionSlot {
+    // Constructed in place on connect, so accepting a connection doesn't allocate
+    std::optional<ClientConnection> connection;
+    uint16_t generation = 1;
+  };
+  // Applied before any per-slot resources are sized
+  static uint32_t clampMaxConnections(uint32_t requested_connections);
+  // Indexed by slot, reserved up front
+  std::vector<ConnectionSlot> connections;
+  // Words in a bitset over slots (e.g. failed_slots)
+  size_t slot_words;
+
+#if PICO_WS_SERVER_BROADCAST
+  // Subscribers of each topic, as consecutive bitsets of slot_words words
+  std::vector<uint32_t> topic_subscribers;
+#endif
 
   uint32_t getConnectionId(ClientConnection* connection);
+  bool hasConnections() { return free_slots.size() < connections.size(); }
+#if PICO_WS_SERVER_BROADCAST
+  // Sends to the connections in the slot_mask bitset, or all connections if it is nullptr
+  bool broadcastMessage(const uint32_t* slot_mask, WebSocketServer::MessageType type, const void* payload,
+                        size_t payload_size, uint32_t* failed_slots);
+  bool broadcastFrame(SharedFrame& frame, const uint32_t* slot_mask, uint32_t* failed_slots);
+  bool publishMessage(uint32_t topic, WebSocketServer::MessageType type, const void* payload, size_t payload_size,
+                      uint32_t* failed_slots);
+  // nullptr if topic is out of range
+  uint32_t* getSubscribers(uint32_t topic);
+  bool hasSubscribers(const uint32_t* subscribers);
+  void clearFailedSlots(uint32_t* failed_slots);
+#endif
+  // Caller must hold the cyw43 lock
   ClientConnection* getConnectionById(uint32_t conn_id);
+
+  // Schedules a check of each connection, and starts the lwIP timeout, if keepalive or idle timeouts are enabled
+  void startTimers();
+  void onConnectionTimer(ClientConnection* connection);
+
+  // Enters the cyw43 lock and a send batch, for WebSocketServer::Batch
+  void lock();
+  void unlock();
 };
 
 #endif
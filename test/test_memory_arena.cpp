@@ -0,0 +1,115 @@
+#include <cstddef>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "memory_arena.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+// A transient buffer released while an older block is still live gives its space back
+void test_transient_with_live_block() {
+  MemoryArena arena(4096);
+  void* live = arena.allocate(64);
+  check(live != nullptr, "live allocate");
+  for (int i = 0; i < 100; i++) {
+    void* scratch = arena.allocate(1000);
+    check(scratch != nullptr, "transient allocate");
+    arena.release(scratch);
+  }
+  // Several transient buffers at once, released newest first
+  for (int i = 0; i < 100; i++) {
+    void* a = arena.allocate(1000);
+    void* b = arena.allocate(1000);
+    void* c = arena.allocate(1000);
+    check(a && b && c, "nested transient allocate");
+    arena.release(c);
+    arena.release(b);
+    arena.release(a);
+  }
+  arena.release(live);
+  check(arena.allocate(4096 - 8) != nullptr, "whole arena after release");
+}
+
+// As above, once the ring has wrapped (the padding at the end is reclaimed along with the transient block)
+void test_transient_after_wrap() {
+  MemoryArena arena(4096);
+  void* first = arena.allocate(3000);
+  void* live = arena.allocate(500);
+  arena.release(first);
+  for (int i = 0; i < 100; i++) {
+    void* scratch = arena.allocate(2000);
+    check(scratch != nullptr, "transient allocate after wrap");
+    arena.release(scratch);
+  }
+  arena.release(live);
+}
+
+// Random lifetimes, checking contents are intact and everything is reclaimed at the end
+void test_random() {
+  MemoryArena arena(8192);
+  struct Block {
+    uint8_t* data;
+    size_t size;
+    uint8_t fill;
+  };
+  std::vector<Block> blocks;
+  uint32_t state = 1;
+  auto next = [&]() {
+    state = state * 1103515245 + 12345;
+    return (state >> 16) & 0x7FFF;
+  };
+
+  for (int i = 0; i < 100000; i++) {
+    if (blocks.empty() || next() % 2) {
+      size_t size = next() % 1500;
+      uint8_t* data = (uint8_t*)arena.allocate(size);
+      if (data) {
+        uint8_t fill = (uint8_t)i;
+        memset(data, fill, size);
+        blocks.push_back({data, size, fill});
+      }
+    } else {
+      // Mostly the oldest or the newest, sometimes one in between
+      size_t r = next() % 4;
+      size_t index = r == 0 ? 0 : r == 1 ? blocks.size() - 1 : next() % blocks.size();
+      Block block = blocks[index];
+      bool intact = true;
+      for (size_t j = 0; j < block.size; j++) {
+        intact &= block.data[j] == block.fill;
+      }
+      check(intact, "contents intact");
+      arena.release(block.data);
+      blocks.erase(blocks.begin() + index);
+    }
+  }
+  for (Block& block : blocks) {
+    arena.release(block.data);
+  }
+  check(arena.allocate(8192 - 8) != nullptr, "whole arena after random use");
+}
+
+} // namespace
+
+int main() {
+  test_transient_with_live_block();
+  test_transient_after_wrap();
+  test_random();
+
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
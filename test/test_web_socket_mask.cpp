@@ -0,0 +1,114 @@
+#include <cstddef>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "web_socket_mask.h"
+
+namespace {
+
+constexpr uint32_t MASK = 0xA1B2C3D4;
+// Bytes on either side of dest that must not be touched
+constexpr size_t GUARD = 16;
+constexpr uint8_t GUARD_BYTE = 0x5A;
+
+// The byte-wise loop mask_copy replaced
+void reference_mask(uint8_t* payload, size_t size, uint32_t mask, size_t offset) {
+  uint8_t big_endian[4];
+  big_endian[0] = (mask >> 24) & 0xFF;
+  big_endian[1] = (mask >> 16) & 0xFF;
+  big_endian[2] = (mask >> 8) & 0xFF;
+  big_endian[3] = mask & 0xFF;
+  for (size_t i = 0; i < size; i++) {
+    payload[i] ^= big_endian[(offset + i) % 4];
+  }
+}
+
+int failures = 0;
+
+void check(bool ok, const char* what, size_t size, size_t offset, size_t src_align, size_t dest_align) {
+  if (!ok) {
+    printf("FAIL %s: size %zu, offset %zu, src align %zu, dest align %zu\n", what, size, offset, src_align,
+           dest_align);
+    failures++;
+  }
+}
+
+void test_copy(size_t size, size_t offset, size_t src_align, size_t dest_align, bool in_place) {
+  static uint8_t src_buf[8192 + 16];
+  static uint8_t dest_buf[8192 + 2 * GUARD + 16];
+  static uint8_t expected[8192];
+
+  uint8_t* src = src_buf + src_align;
+  for (size_t i = 0; i < size; i++) {
+    src[i] = (uint8_t)(i * 31 + 7);
+  }
+  memcpy(expected, src, size);
+  reference_mask(expected, size, MASK, offset);
+
+  memset(dest_buf, GUARD_BYTE, sizeof(dest_buf));
+  uint8_t* dest = dest_buf + GUARD + dest_align;
+  if (in_place) {
+    memcpy(dest, src, size);
+    mask_copy(dest, dest, size, MASK, offset);
+  } else {
+    mask_copy(dest, src, size, MASK, offset);
+  }
+
+  check(memcmp(dest, expected, size) == 0, in_place ? "in place" : "copy", size, offset, src_align, dest_align);
+  bool guard_ok = true;
+  for (size_t i = 0; i < GUARD + dest_align; i++) {
+    guard_ok &= dest_buf[i] == GUARD_BYTE;
+  }
+  for (size_t i = GUARD + dest_align + size; i < sizeof(dest_buf); i++) {
+    guard_ok &= dest_buf[i] == GUARD_BYTE;
+  }
+  check(guard_ok, "write outside dest", size, offset, src_align, dest_align);
+}
+
+// Unmasking in pieces (as across pbuf boundaries) matches unmasking all at once
+void test_pieces() {
+  uint8_t payload[300];
+  uint8_t expected[300];
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = (uint8_t)(i * 13 + 1);
+  }
+  memcpy(expected, payload, sizeof(expected));
+  reference_mask(expected, sizeof(expected), MASK, 0);
+
+  const size_t cuts[] = {0, 1, 3, 7, 8, 15, 64, 65, 129, 250, 299, 300};
+  for (size_t i = 0; i + 1 < sizeof(cuts) / sizeof(cuts[0]); i++) {
+    mask_copy(payload + cuts[i], payload + cuts[i], cuts[i + 1] - cuts[i], MASK, cuts[i]);
+  }
+  check(memcmp(payload, expected, sizeof(payload)) == 0, "pieces", sizeof(payload), 0, 0, 0);
+}
+
+} // namespace
+
+int main() {
+  const size_t large_sizes[] = {65, 127, 128, 129, 1000, 4099, 8192};
+  const size_t offsets[] = {0, 1, 2, 3, 4, 5, 1001};
+
+  for (size_t offset : offsets) {
+    for (size_t src_align = 0; src_align < 8; src_align++) {
+      for (size_t dest_align = 0; dest_align < 8; dest_align++) {
+        for (size_t size = 0; size <= 64; size++) {
+          test_copy(size, offset, src_align, dest_align, false);
+          test_copy(size, offset, src_align, dest_align, true);
+        }
+        for (size_t size : large_sizes) {
+          test_copy(size, offset, src_align, dest_align, false);
+          test_copy(size, offset, src_align, dest_align, true);
+        }
+      }
+    }
+  }
+  test_pieces();
+
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}